@@ -0,0 +1,411 @@
+/* reuse_bench: times the reuse distance tools' per-reference path on
+ * synthetic traces, without DynamoRIO running an application.
+ *
+ *   reuse_bench [-pattern P,...] [-footprint SIZE,...] [-engine E,...]
+ *               [-refs N] [-stride BYTES] [-zipf S] [-line_size BYTES]
+ *               [-seed N] [-instr] [-print]
+ *
+ * Every pattern x footprint x engine combination runs in its own child
+ * process, so each gets a fresh heap and its own peak RSS.  The child feeds
+ * N memref_t records to reuse_distance_t::process_memref and prints one line:
+ * ns per reference, references per second, the allocations and bytes
+ * allocated while processing, and the peak RSS.  The records are generated in
+ * batches outside the timed region.
+ *
+ * Patterns, over a footprint of SIZE bytes (K/M/G suffixes):
+ *   seq      8-byte accesses walking the footprint in order
+ *   stride   one access every -stride bytes, shifted by a line on each pass
+ *   uniform  uniformly random lines
+ *   zipf     lines ranked by a Zipf distribution of exponent -zipf
+ *   chase    a pseudo-random cycle through every line, as a linked list walk
+ * -engine sets WPC_REUSE_ENGINE for the run; other WPC_* knobs are taken from
+ * the environment as usual.  -instr makes the records instruction fetches
+ * and sets WPC_REUSE_STREAM=instr.  -print prints the tool's results to stderr.
+ *
+ * Build it next to reuse/reuse_distance.cpp in the DynamoRIO tree, for example:
+ * g++ -O2 -std=c++11 -I<dr>/clients/drcachesim/common -I<dr>/clients/drcachesim/tools
+ *     reuse_bench.cpp <dr>/clients/drcachesim/tools/reuse_distance.cpp
+ *     <dr>/clients/drcachesim/common/trace_entry.cpp -o reuse_bench -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+#include "reuse_distance_create.h"
+
+/* Every allocation of the process is counted; a run reports the difference
+ * across its timed region.
+ */
+static std::atomic<uint64_t> alloc_count(0);
+static std::atomic<uint64_t> alloc_bytes(0);
+
+static void *
+counted_alloc(size_t size)
+{
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    void *ptr = malloc(size == 0 ? 1 : size);
+    if (ptr == NULL)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void *
+operator new(size_t size)
+{
+    return counted_alloc(size);
+}
+
+void *
+operator new[](size_t size)
+{
+    return counted_alloc(size);
+}
+
+void
+operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void
+operator delete[](void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void
+operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+void
+operator delete[](void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+enum pattern_t { PATTERN_SEQ, PATTERN_STRIDE, PATTERN_UNIFORM, PATTERN_ZIPF, PATTERN_CHASE };
+
+static const char *const pattern_names[] = { "seq", "stride", "uniform", "zipf", "chase" };
+
+struct bench_options_t {
+    uint64_t refs = 10000000;
+    uint64_t stride = 4096;
+    double zipf = 0.99;
+    unsigned int line_size = 64;
+    uint64_t seed = 42;
+    bool instr = false;
+    bool print = false;
+};
+
+/* Produces the addresses of one pattern.  Each call is cheap next to the
+ * tool's work, but the caller still keeps it out of the timed region.
+ */
+class address_stream_t {
+public:
+    address_stream_t(pattern_t pattern, uint64_t footprint, const bench_options_t &options)
+        : pattern_(pattern)
+        , footprint_(footprint)
+        , line_size_(options.line_size)
+        , lines_(std::max<uint64_t>(footprint / options.line_size, 1))
+        , stride_(std::max<uint64_t>(options.stride, 1))
+        , pos_(0)
+        , pass_(0)
+        , rng_(options.seed)
+    {
+        // The chase cycle is a full-period LCG modulo the next power of two,
+        // skipping the values past the last line.
+        chase_mask_ = 1;
+        while (chase_mask_ < lines_)
+            chase_mask_ <<= 1;
+        --chase_mask_;
+        zipf_exp_ = 1.0 - options.zipf;
+        zipf_span_ = std::fabs(zipf_exp_) < 1e-9
+            ? std::log(static_cast<double>(lines_) + 1)
+            : std::pow(static_cast<double>(lines_) + 1, zipf_exp_) - 1;
+    }
+
+    addr_t
+    next()
+    {
+        switch (pattern_) {
+        case PATTERN_SEQ:
+            pos_ += 8;
+            if (pos_ >= footprint_)
+                pos_ = 0;
+            return pos_;
+        case PATTERN_STRIDE:
+            pos_ += stride_;
+            if (pos_ >= footprint_) {
+                ++pass_;
+                pos_ = stride_ > line_size_ ? (pass_ * line_size_) % stride_ : 0;
+            }
+            return pos_;
+        case PATTERN_UNIFORM: return (rng_() % lines_) * line_size_;
+        case PATTERN_ZIPF: {
+            double u = std::uniform_real_distribution<double>(0, 1)(rng_);
+            double x = std::fabs(zipf_exp_) < 1e-9
+                ? std::exp(u * zipf_span_)
+                : std::pow(1 + u * zipf_span_, 1 / zipf_exp_);
+            uint64_t rank = std::min(static_cast<uint64_t>(x) - 1, lines_ - 1);
+            return rank * line_size_;
+        }
+        case PATTERN_CHASE:
+            do {
+                pos_ = (pos_ * 6364136223846793005ULL + 1442695040888963407ULL) &
+                    chase_mask_;
+            } while (pos_ >= lines_);
+            return pos_ * line_size_;
+        }
+        return 0;
+    }
+
+private:
+    pattern_t pattern_;
+    uint64_t footprint_;
+    uint64_t line_size_;
+    uint64_t lines_;
+    uint64_t stride_;
+    uint64_t pos_;
+    uint64_t pass_;
+    uint64_t chase_mask_;
+    double zipf_exp_;
+    double zipf_span_;
+    std::mt19937_64 rng_;
+};
+
+static bool
+parse_size(const std::string &text, uint64_t *size)
+{
+    char *end;
+    double value = strtod(text.c_str(), &end);
+    switch (*end) {
+    case 'k':
+    case 'K': value *= 1ULL << 10; ++end; break;
+    case 'm':
+    case 'M': value *= 1ULL << 20; ++end; break;
+    case 'g':
+    case 'G': value *= 1ULL << 30; ++end; break;
+    case 't':
+    case 'T': value *= 1ULL << 40; ++end; break;
+    }
+    if (end == text.c_str() || (*end != '\0' && strcmp(end, "B") != 0) || value < 1)
+        return false;
+    *size = static_cast<uint64_t>(value);
+    return true;
+}
+
+static std::vector<std::string>
+split_list(const char *text)
+{
+    std::vector<std::string> items;
+    std::string item;
+    for (const char *c = text;; ++c) {
+        if (*c == ',' || *c == '\0') {
+            if (!item.empty())
+                items.push_back(item);
+            item.clear();
+            if (*c == '\0')
+                break;
+        } else
+            item += *c;
+    }
+    return items;
+}
+
+static std::string
+format_size(uint64_t size)
+{
+    static const char *const units[] = { "B", "K", "M", "G", "T" };
+    int unit = 0;
+    while (unit < 4 && size >= 1024 && size % 1024 == 0) {
+        size /= 1024;
+        ++unit;
+    }
+    return std::to_string(size) + units[unit];
+}
+
+/* Runs one configuration in the calling process and prints its line. */
+static int
+run_one(pattern_t pattern, uint64_t footprint, const std::string &engine,
+        const bench_options_t &options)
+{
+    if (!engine.empty())
+        setenv("WPC_REUSE_ENGINE", engine.c_str(), 1);
+    if (options.instr)
+        setenv("WPC_REUSE_STREAM", "instr", 1);
+    // Tags of whole lines, which the miss ratio curve needs, unless the
+    // environment picks the granularities.
+    setenv("WPC_LINE_SHIFTS",
+           std::to_string(static_cast<int>(std::log2(options.line_size))).c_str(), 0);
+    reuse_distance_knobs_t knobs;
+    knobs.line_size = options.line_size;
+    analysis_tool_t *tool = reuse_distance_tool_create(knobs);
+    if (tool == NULL || !*tool) {
+        fprintf(stderr, "failed to create the tool: %s\n",
+                tool == NULL ? "" : tool->get_error_string().c_str());
+        return 1;
+    }
+    address_stream_t stream(pattern, footprint, options);
+    static const size_t BATCH = 4096;
+    std::vector<memref_t> batch(BATCH);
+    for (size_t i = 0; i < BATCH; ++i) {
+        memset(&batch[i], 0, sizeof(batch[i]));
+        batch[i].data.type = options.instr ? TRACE_TYPE_INSTR : TRACE_TYPE_READ;
+        batch[i].data.pid = 1;
+        batch[i].data.tid = 1;
+        batch[i].data.size = options.instr ? 4 : 8;
+    }
+    uint64_t start_count = alloc_count.load();
+    uint64_t start_bytes = alloc_bytes.load();
+    std::chrono::steady_clock::duration elapsed(0);
+    for (uint64_t done = 0; done < options.refs;) {
+        size_t count = static_cast<size_t>(std::min<uint64_t>(BATCH, options.refs - done));
+        for (size_t i = 0; i < count; ++i) {
+            addr_t addr = stream.next();
+            batch[i].data.addr = addr;
+            batch[i].data.pc = options.instr ? addr : 0x400000 + (i % 64) * 4;
+        }
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < count; ++i) {
+            if (!tool->process_memref(batch[i])) {
+                fprintf(stderr, "process_memref failed: %s\n",
+                        tool->get_error_string().c_str());
+                return 1;
+            }
+        }
+        elapsed += std::chrono::steady_clock::now() - begin;
+        done += count;
+    }
+    uint64_t allocs = alloc_count.load() - start_count;
+    uint64_t bytes = alloc_bytes.load() - start_bytes;
+    double ns = static_cast<double>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%-8s %9s %-6s %12llu %10.1f %12.0f %12llu %14llu %12.1f\n",
+           pattern_names[pattern], format_size(footprint).c_str(),
+           engine.empty() ? "-" : engine.c_str(), (unsigned long long)options.refs,
+           ns / options.refs, options.refs / (ns / 1e9), (unsigned long long)allocs,
+           (unsigned long long)bytes, usage.ru_maxrss / 1024.0);
+    fflush(stdout);
+    if (options.print)
+        tool->print_results();
+    delete tool;
+    return 0;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-pattern seq,stride,uniform,zipf,chase] [-footprint 1M,...]\n"
+            "       [-engine tree,list,hotl] [-refs N] [-stride BYTES] [-zipf S]\n"
+            "       [-line_size BYTES] [-seed N] [-instr] [-print]\n",
+            name);
+}
+
+int
+main(int argc, char **argv)
+{
+    bench_options_t options;
+    std::vector<pattern_t> patterns;
+    std::vector<uint64_t> footprints;
+    std::vector<std::string> engines;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "-instr")
+            options.instr = true;
+        else if (arg == "-print")
+            options.print = true;
+        else if (arg == "-pattern" && has_value) {
+            for (const std::string &name : split_list(argv[++i])) {
+                size_t p = 0;
+                while (p < sizeof(pattern_names) / sizeof(pattern_names[0]) &&
+                       name != pattern_names[p])
+                    ++p;
+                if (p == sizeof(pattern_names) / sizeof(pattern_names[0])) {
+                    fprintf(stderr, "unknown pattern %s\n", name.c_str());
+                    return 1;
+                }
+                patterns.push_back(static_cast<pattern_t>(p));
+            }
+        } else if (arg == "-footprint" && has_value) {
+            for (const std::string &text : split_list(argv[++i])) {
+                uint64_t size;
+                if (!parse_size(text, &size)) {
+                    fprintf(stderr, "bad footprint %s\n", text.c_str());
+                    return 1;
+                }
+                footprints.push_back(size);
+            }
+        } else if (arg == "-engine" && has_value)
+            engines = split_list(argv[++i]);
+        else if (arg == "-refs" && has_value)
+            options.refs = strtoull(argv[++i], NULL, 0);
+        else if (arg == "-stride" && has_value)
+            options.stride = strtoull(argv[++i], NULL, 0);
+        else if (arg == "-zipf" && has_value)
+            options.zipf = atof(argv[++i]);
+        else if (arg == "-line_size" && has_value)
+            options.line_size = atoi(argv[++i]);
+        else if (arg == "-seed" && has_value)
+            options.seed = strtoull(argv[++i], NULL, 0);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.refs == 0 || options.line_size == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (patterns.empty()) {
+        for (int p = PATTERN_SEQ; p <= PATTERN_CHASE; ++p)
+            patterns.push_back(static_cast<pattern_t>(p));
+    }
+    if (footprints.empty())
+        footprints = { 1ULL << 20, 64ULL << 20, 1ULL << 30 };
+    if (engines.empty())
+        engines.push_back("");
+
+    printf("%-8s %9s %-6s %12s %10s %12s %12s %14s %12s\n", "pattern", "footprint",
+           "engine", "refs", "ns/ref", "refs/sec", "allocs", "alloc bytes", "peak RSS MB");
+    fflush(stdout);
+    int status = 0;
+    for (pattern_t pattern : patterns) {
+        for (uint64_t footprint : footprints) {
+            for (const std::string &engine : engines) {
+                pid_t child = fork();
+                if (child < 0) {
+                    perror("fork");
+                    return 1;
+                }
+                if (child == 0)
+                    _exit(run_one(pattern, footprint, engine, options));
+                int child_status;
+                if (waitpid(child, &child_status, 0) < 0 || !WIFEXITED(child_status) ||
+                    WEXITSTATUS(child_status) != 0) {
+                    fprintf(stderr, "%s %s %s failed\n", pattern_names[pattern],
+                            format_size(footprint).c_str(), engine.c_str());
+                    status = 1;
+                }
+            }
+        }
+    }
+    return status;
+}
@@ -0,0 +1,438 @@
+/* branch_outcomes: replay the outcome streams written by the branch view tool.
+ *
+ *   branch_outcomes [-branches] [-gshare BITS] FILE...
+ *       For each file (one shard's WPC_OUTCOME_FILE.N), the bias entropy and
+ *       the mispredictions of a last-outcome and a 2-bit counter predictor per
+ *       branch, from the per-branch streams alone; with FILE.order next to it,
+ *       also a gshare predictor with 2^BITS counters (default 14) replayed in
+ *       execution order.  -branches adds a line per branch.
+ *
+ * The per-branch kernels work a 64-bit word (64 executions) at a time: taken
+ * counts are popcounts, the last-outcome predictor's misses are the popcount
+ * of a word xor itself shifted by one, and the 2-bit counter steps a byte at a
+ * time through a table.  Files are mapped read-only, so several replays can
+ * run over the same file at once.
+ *
+ * g++ -O3 -march=native -std=c++11 branch_outcomes.cpp -o branch_outcomes
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <vector>
+#include "branch_outcomes.h"
+
+/* A read-only mapping of a file. */
+struct mapped_file_t {
+    mapped_file_t()
+        : data_(NULL)
+        , size_(0)
+    {
+    }
+
+    ~mapped_file_t()
+    {
+        if (data_ != NULL)
+            munmap(data_, size_);
+    }
+
+    bool
+    open(const std::string &path, std::string *error)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            *error = strerror(errno);
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            *error = strerror(errno);
+            close(fd);
+            return false;
+        }
+        size_ = st.st_size;
+        if (size_ > 0)
+            data_ = mmap(NULL, size_, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+        close(fd);
+        if (data_ == MAP_FAILED) {
+            data_ = NULL;
+            *error = strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+    const void *
+    data() const
+    {
+        return data_ == NULL ? "" : data_;
+    }
+
+    size_t
+    size() const
+    {
+        return size_;
+    }
+
+private:
+    mapped_file_t(const mapped_file_t &);
+    mapped_file_t &
+    operator=(const mapped_file_t &);
+
+    void *data_;
+    size_t size_;
+};
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: branch_outcomes [-branches] [-gshare BITS] FILE...\n");
+}
+
+// For a 2-bit counter in state s (0-1 predict untaken, 2-3 taken) fed the 8
+// outcomes of byte b, bit 0 first: the final state in bits 0-1 and the
+// mispredictions above.
+struct counter_table_t {
+    counter_table_t()
+    {
+        for (int state = 0; state < 4; ++state) {
+            for (int byte = 0; byte < 256; ++byte) {
+                int s = state, misses = 0;
+                for (int bit = 0; bit < 8; ++bit)
+                    misses += step(&s, byte >> bit & 1);
+                table[state][byte] = static_cast<uint8_t>(s | misses << 2);
+            }
+        }
+    }
+    // Returns whether the counter mispredicted taken.
+    static int
+    step(int *state, int taken)
+    {
+        int miss = (*state >= 2) != taken;
+        if (taken && *state < 3)
+            ++*state;
+        else if (!taken && *state > 0)
+            --*state;
+        return miss;
+    }
+    uint8_t table[4][256];
+};
+
+struct branch_state_t {
+    uint64_t taken = 0;
+    uint64_t last = 0; // The last outcome, as the next word's bit 0 prediction.
+    uint64_t last_misses = 0;
+    int counter = 1; // Weakly not-taken, as the view tool's bimodal model starts.
+    uint64_t counter_misses = 0;
+};
+
+// Counts the taken outcomes and the last-outcome predictor's misses in one
+// chunk of bits outcomes.
+static void
+replay_bits(const uint64_t *words, uint32_t bits, branch_state_t *branch)
+{
+    uint64_t taken = 0, last_misses = 0;
+    uint64_t last = branch->last;
+    if (bits == BRANCH_OUTCOMES_CHUNK_BITS) {
+        // Whole words, each shifted in the previous one's top bit.
+        for (uint32_t i = 0; i < BRANCH_OUTCOMES_CHUNK_WORDS; ++i) {
+            uint64_t previous = i == 0 ? last : words[i - 1] >> 63;
+            taken += __builtin_popcountll(words[i]);
+            last_misses += __builtin_popcountll(words[i] ^ (words[i] << 1 | previous));
+        }
+        branch->taken += taken;
+        branch->last_misses += last_misses;
+        branch->last = words[BRANCH_OUTCOMES_CHUNK_WORDS - 1] >> 63;
+        return;
+    }
+    for (uint32_t i = 0; i < BRANCH_OUTCOMES_CHUNK_WORDS && i * 64 < bits; ++i) {
+        uint64_t valid = bits - i * 64 >= 64 ? ~0ULL : (1ULL << (bits - i * 64)) - 1;
+        uint64_t word = words[i] & valid;
+        taken += __builtin_popcountll(word);
+        last_misses += __builtin_popcountll((word ^ (word << 1 | last)) & valid);
+        last = word >> ((bits - i * 64 >= 64 ? 64 : bits - i * 64) - 1) & 1;
+    }
+    branch->taken += taken;
+    branch->last_misses += last_misses;
+    branch->last = last;
+}
+
+// Steps the 2-bit counter through one chunk of bits outcomes.
+static void
+replay_counter(const counter_table_t &counters, const uint64_t *words, uint32_t bits,
+               branch_state_t *branch)
+{
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(words);
+    int state = branch->counter;
+    uint64_t counter_misses = 0;
+    uint32_t whole = bits / 8;
+    for (uint32_t i = 0; i < whole; ++i) {
+        uint8_t next = counters.table[state][bytes[i]];
+        state = next & 3;
+        counter_misses += next >> 2;
+    }
+    for (uint32_t bit = whole * 8; bit < bits; ++bit)
+        counter_misses += counter_table_t::step(&state, bytes[bit / 8] >> (bit % 8) & 1);
+    branch->counter = state;
+    branch->counter_misses += counter_misses;
+}
+
+// As replay_counter for COUNTER_LANES full chunks of distinct branches.  Each
+// counter's table lookups depend on the previous one, so stepping several at
+// once keeps more loads in flight.
+static const int COUNTER_LANES = 4;
+
+static void
+replay_counters(const counter_table_t &counters, const uint64_t *const *words,
+                branch_state_t *const *branches)
+{
+    int state[COUNTER_LANES];
+    uint64_t misses[COUNTER_LANES] = {};
+    const uint8_t *bytes[COUNTER_LANES];
+    for (int lane = 0; lane < COUNTER_LANES; ++lane) {
+        state[lane] = branches[lane]->counter;
+        bytes[lane] = reinterpret_cast<const uint8_t *>(words[lane]);
+    }
+    for (uint32_t i = 0; i < BRANCH_OUTCOMES_CHUNK_BITS / 8; ++i) {
+        for (int lane = 0; lane < COUNTER_LANES; ++lane) {
+            uint8_t next = counters.table[state[lane]][bytes[lane][i]];
+            state[lane] = next & 3;
+            misses[lane] += next >> 2;
+        }
+    }
+    for (int lane = 0; lane < COUNTER_LANES; ++lane) {
+        branches[lane]->counter = state[lane];
+        branches[lane]->counter_misses += misses[lane];
+    }
+}
+
+static double
+xlog2x(double n)
+{
+    return n <= 0 ? 0 : n * std::log2(n);
+}
+
+static void
+print_misses(const char *model, uint64_t misses, uint64_t execs, uint64_t instrs)
+{
+    printf("%s: %llu mispredictions, MPKI %.4f, accuracy %.4f%%\n", model,
+           static_cast<unsigned long long>(misses),
+           instrs == 0 ? 0. : 1000. * misses / instrs,
+           execs == 0 ? 0. : 100. * (execs - misses) / execs);
+}
+
+static inline size_t
+pc_index(uint64_t pc, int bits)
+{
+    return static_cast<size_t>(pc ^ (pc >> bits)) & ((static_cast<size_t>(1) << bits) - 1);
+}
+
+// Replays the streams in execution order through gshare as the view tool
+// models it: 2^bits 2-bit counters indexed by the pc xor as many global
+// outcomes, newest in bit 0.
+static uint64_t
+replay_gshare(const branch_outcomes_header_t *header, const uint32_t *order, int bits)
+{
+    const branch_outcomes_chunk_t *index = branch_outcomes_index(header);
+    const branch_outcomes_branch_t *branches = branch_outcomes_branches(header);
+    // Each branch's chunks in order, as offsets into one array.
+    std::vector<uint64_t> start(header->branches + 1, 0);
+    for (uint64_t i = 0; i < header->chunks; ++i)
+        ++start[index[i].branch + 1];
+    for (uint64_t b = 0; b < header->branches; ++b)
+        start[b + 1] += start[b];
+    std::vector<uint64_t> chunks(header->chunks);
+    std::vector<uint64_t> fill(start.begin(), start.end() - 1);
+    for (uint64_t i = 0; i < header->chunks; ++i)
+        chunks[fill[index[i].branch]++] = i;
+
+    std::vector<uint64_t> position(header->branches, 0);
+    std::vector<uint8_t> counters(static_cast<size_t>(1) << bits, 1);
+    uint64_t mask = (1ULL << bits) - 1;
+    uint64_t history = 0, misses = 0;
+    for (uint64_t i = 0; i < header->execs; ++i) {
+        uint32_t branch = order[i];
+        uint64_t pos = position[branch]++;
+        const uint64_t *words = branch_outcomes_words(
+            header, chunks[start[branch] + pos / BRANCH_OUTCOMES_CHUNK_BITS]);
+        uint64_t bit = pos % BRANCH_OUTCOMES_CHUNK_BITS;
+        int taken = words[bit / 64] >> (bit % 64) & 1;
+        uint8_t &counter = counters[pc_index(branches[branch].pc ^ (history & mask), bits)];
+        misses += (counter >= 2) != taken;
+        if (taken && counter < 3)
+            ++counter;
+        else if (!taken && counter > 0)
+            --counter;
+        history = history << 1 | taken;
+    }
+    return misses;
+}
+
+static bool
+replay(const char *path, bool per_branch, int gshare_bits,
+       const counter_table_t &counters)
+{
+    mapped_file_t file;
+    std::string error;
+    const branch_outcomes_header_t *header = NULL;
+    if (file.open(path, &error))
+        header = branch_outcomes_check(file.data(), file.size(), &error);
+    if (header == NULL) {
+        fprintf(stderr, "%s: %s\n", path, error.c_str());
+        return false;
+    }
+    const branch_outcomes_chunk_t *index = branch_outcomes_index(header);
+    const branch_outcomes_branch_t *branches = branch_outcomes_branches(header);
+    for (uint64_t i = 0; i < header->chunks; ++i) {
+        if (index[i].branch >= header->branches ||
+            index[i].bits > BRANCH_OUTCOMES_CHUNK_BITS) {
+            fprintf(stderr, "%s: corrupt chunk index\n", path);
+            return false;
+        }
+    }
+
+    std::vector<branch_state_t> states(header->branches);
+    double bytes = header->chunks * BRANCH_OUTCOMES_CHUNK_WORDS * sizeof(uint64_t);
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < header->chunks; ++i) {
+        replay_bits(branch_outcomes_words(header, i), index[i].bits,
+                    &states[index[i].branch]);
+    }
+    double bits_seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < header->chunks;) {
+        // A branch's chunks must be stepped in order, so lanes need distinct
+        // branches; chunks of one branch usually sit far apart in the file.
+        bool lanes = i + COUNTER_LANES <= header->chunks;
+        for (int lane = 0; lanes && lane < COUNTER_LANES; ++lane) {
+            lanes = index[i + lane].bits == BRANCH_OUTCOMES_CHUNK_BITS;
+            for (int other = 0; lanes && other < lane; ++other)
+                lanes = index[i + lane].branch != index[i + other].branch;
+        }
+        if (lanes) {
+            const uint64_t *words[COUNTER_LANES];
+            branch_state_t *branches_in_lanes[COUNTER_LANES];
+            for (int lane = 0; lane < COUNTER_LANES; ++lane) {
+                words[lane] = branch_outcomes_words(header, i + lane);
+                branches_in_lanes[lane] = &states[index[i + lane].branch];
+            }
+            replay_counters(counters, words, branches_in_lanes);
+            i += COUNTER_LANES;
+        } else {
+            replay_counter(counters, branch_outcomes_words(header, i), index[i].bits,
+                           &states[index[i].branch]);
+            ++i;
+        }
+    }
+    double counter_seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    uint64_t taken = 0, last_misses = 0, counter_misses = 0;
+    double linear = 0, cost = 0;
+    for (uint64_t b = 0; b < header->branches; ++b) {
+        const branch_state_t &state = states[b];
+        if (state.taken != branches[b].taken) {
+            fprintf(stderr, "%s: branch %llu has %llu taken in its stream, %llu in the table\n",
+                    path, static_cast<unsigned long long>(b),
+                    static_cast<unsigned long long>(state.taken),
+                    static_cast<unsigned long long>(branches[b].taken));
+            return false;
+        }
+        uint64_t execs = branches[b].execs;
+        taken += state.taken;
+        last_misses += state.last_misses;
+        counter_misses += state.counter_misses;
+        linear += 2.0 * std::min(state.taken, execs - state.taken);
+        cost += xlog2x(execs) - xlog2x(state.taken) - xlog2x(execs - state.taken);
+    }
+    uint64_t execs = header->execs;
+    printf("%s: shard %d, %llu branches, %llu executions, %llu taken, %llu instructions, "
+           "%.1f MB of outcomes\n",
+           path, header->shard, static_cast<unsigned long long>(header->branches),
+           static_cast<unsigned long long>(execs), static_cast<unsigned long long>(taken),
+           static_cast<unsigned long long>(header->instrs), bytes / 1048576.0);
+    printf("branch linear entropy: %f, entropy (bits): %f\n",
+           execs == 0 ? 0. : linear / execs, execs == 0 ? 0. : cost / execs);
+    print_misses("last outcome", last_misses, execs, header->instrs);
+    print_misses("2-bit counter", counter_misses, execs, header->instrs);
+    printf("popcount and shift kernels: %.3f seconds, %.2f GB/s; 2-bit counter: %.3f "
+           "seconds, %.2f GB/s\n",
+           bits_seconds, bits_seconds > 0 ? bytes / bits_seconds / 1e9 : 0.,
+           counter_seconds, counter_seconds > 0 ? bytes / counter_seconds / 1e9 : 0.);
+
+    mapped_file_t order;
+    std::string order_path = std::string(path) + ".order";
+    if (access(order_path.c_str(), R_OK) == 0) {
+        if (!order.open(order_path, &error) || order.size() != execs * sizeof(uint32_t)) {
+            fprintf(stderr, "%s: %s\n", order_path.c_str(),
+                    error.empty() ? "does not match the outcome file" : error.c_str());
+            return false;
+        }
+        const uint32_t *ids = reinterpret_cast<const uint32_t *>(order.data());
+        for (uint64_t i = 0; i < execs; ++i) {
+            if (ids[i] >= header->branches) {
+                fprintf(stderr, "%s: corrupt branch id\n", order_path.c_str());
+                return false;
+            }
+        }
+        start = std::chrono::steady_clock::now();
+        uint64_t misses = replay_gshare(header, ids, gshare_bits);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                      .count();
+        std::string model = "gshare " + std::to_string(gshare_bits) + " bits";
+        print_misses(model.c_str(), misses, execs, header->instrs);
+        printf("in-order replay: %.3f seconds, %.0f executions/sec\n", seconds,
+               seconds > 0 ? execs / seconds : 0.);
+    }
+
+    if (per_branch) {
+        for (uint64_t b = 0; b < header->branches; ++b) {
+            printf("branch:%llu: execs %llu, taken %llu, last %llu, counter %llu\n",
+                   static_cast<unsigned long long>(branches[b].pc),
+                   static_cast<unsigned long long>(branches[b].execs),
+                   static_cast<unsigned long long>(states[b].taken),
+                   static_cast<unsigned long long>(states[b].last_misses),
+                   static_cast<unsigned long long>(states[b].counter_misses));
+        }
+    }
+    return true;
+}
+
+int
+main(int argc, char **argv)
+{
+    bool per_branch = false;
+    int gshare_bits = 14;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        if (strcmp(argv[i], "-branches") == 0) {
+            per_branch = true;
+        } else if (strcmp(argv[i], "-gshare") == 0 && i + 1 < argc) {
+            gshare_bits = std::max(1, std::min(atoi(argv[++i]), 30));
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (i == argc) {
+        usage();
+        return 1;
+    }
+    counter_table_t counters;
+    int status = 0;
+    for (; i < argc; ++i) {
+        if (!replay(argv[i], per_branch, gshare_bits, counters))
+            status = 1;
+    }
+    return status;
+}
@@ -0,0 +1,140 @@
+/* branch_outcomes: the bit-packed outcome streams of the branch view tool.
+ *
+ * With WPC_OUTCOME_FILE set, each shard of view.cpp writes one file holding
+ * the outcome of every execution of every conditional branch, one bit each
+ * (1 when the branch was taken, 0 when it fell through to the next
+ * instruction).  The file is a branch_outcomes_header_t, then header.chunks
+ * chunks of BRANCH_OUTCOMES_CHUNK_WORDS 64-bit words, then one
+ * branch_outcomes_chunk_t per chunk, then one branch_outcomes_branch_t per
+ * static branch.  A chunk holds up to 512 consecutive executions of a single
+ * branch, the first in bit 0 of word 0; chunks are stored in the order they
+ * filled, so a branch's chunks appear in execution order.  The chunk index
+ * gives each chunk's branch and its position in the shard's sequence of
+ * branch executions, so streams can be read per branch without the rest.
+ *
+ * With WPC_OUTCOME_ORDER=1 the shard also writes FILE.order: the branch id of
+ * every execution as a uint32_t, in execution order, for replaying models that
+ * need the global interleaving.
+ *
+ * Everything sits at fixed offsets in native (little-endian) byte order, so
+ * readers mmap the files and index them in place, and any number of readers
+ * can share one file.  Copy this header into clients/drcachesim/tools/ next to
+ * view.cpp.
+ */
+
+#ifndef _BRANCH_OUTCOMES_H_
+#define _BRANCH_OUTCOMES_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+static const char BRANCH_OUTCOMES_MAGIC[8] = { 'W', 'P', 'C', 'B', 'R', 'B', 'I', 'T' };
+// Bump whenever the layout or meaning below changes.  Version 1 files hold
+// inverted outcomes (1 for a fall-through) and are not read.
+static const uint32_t BRANCH_OUTCOMES_VERSION = 2;
+static const uint32_t BRANCH_OUTCOMES_CHUNK_WORDS = 8;
+static const uint32_t BRANCH_OUTCOMES_CHUNK_BITS = BRANCH_OUTCOMES_CHUNK_WORDS * 64;
+
+struct branch_outcomes_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t chunk_words;
+    int32_t shard; // the shard index, or the thread id in view's serial mode
+    uint64_t chunks;
+    uint64_t branches;
+    uint64_t execs; // all branch executions, the length of FILE.order
+    uint64_t instrs; // instructions of the shard, for MPKI
+    uint64_t reserved;
+};
+
+struct branch_outcomes_chunk_t {
+    uint32_t branch; // index into the branch table
+    uint32_t bits; // executions in the chunk, BRANCH_OUTCOMES_CHUNK_BITS but the last
+    uint64_t first; // the shard-wide sequence number of its first execution
+};
+
+struct branch_outcomes_branch_t {
+    uint64_t pc;
+    uint64_t execs;
+    uint64_t taken;
+};
+
+static_assert(sizeof(branch_outcomes_header_t) == 64, "branch_outcomes_header_t layout");
+static_assert(sizeof(branch_outcomes_chunk_t) == 16, "branch_outcomes_chunk_t layout");
+
+static inline void
+branch_outcomes_header_init(branch_outcomes_header_t *header, int shard, uint64_t chunks,
+                            uint64_t branches, uint64_t execs, uint64_t instrs)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, BRANCH_OUTCOMES_MAGIC, sizeof(header->magic));
+    header->version = BRANCH_OUTCOMES_VERSION;
+    header->header_size = sizeof(*header);
+    header->chunk_words = BRANCH_OUTCOMES_CHUNK_WORDS;
+    header->shard = shard;
+    header->chunks = chunks;
+    header->branches = branches;
+    header->execs = execs;
+    header->instrs = instrs;
+}
+
+static inline uint64_t
+branch_outcomes_file_size(const branch_outcomes_header_t *header)
+{
+    return header->header_size +
+        header->chunks *
+        (header->chunk_words * sizeof(uint64_t) + sizeof(branch_outcomes_chunk_t)) +
+        header->branches * sizeof(branch_outcomes_branch_t);
+}
+
+// Returns the header if data holds a whole outcome file this code can read,
+// or NULL with the reason in *error.
+static inline const branch_outcomes_header_t *
+branch_outcomes_check(const void *data, size_t size, std::string *error)
+{
+    const branch_outcomes_header_t *header =
+        reinterpret_cast<const branch_outcomes_header_t *>(data);
+    if (size < sizeof(*header) ||
+        memcmp(header->magic, BRANCH_OUTCOMES_MAGIC, sizeof(header->magic)) != 0) {
+        *error = "not a branch outcome file";
+        return NULL;
+    }
+    if (header->version != BRANCH_OUTCOMES_VERSION) {
+        *error = "unsupported outcome file version " + std::to_string(header->version);
+        return NULL;
+    }
+    if (header->header_size < sizeof(*header) ||
+        header->chunk_words != BRANCH_OUTCOMES_CHUNK_WORDS ||
+        branch_outcomes_file_size(header) > size) {
+        *error = "truncated or inconsistent outcome file";
+        return NULL;
+    }
+    return header;
+}
+
+static inline const uint64_t *
+branch_outcomes_words(const branch_outcomes_header_t *header, uint64_t chunk)
+{
+    return reinterpret_cast<const uint64_t *>(reinterpret_cast<const char *>(header) +
+                                              header->header_size) +
+        chunk * header->chunk_words;
+}
+
+static inline const branch_outcomes_chunk_t *
+branch_outcomes_index(const branch_outcomes_header_t *header)
+{
+    return reinterpret_cast<const branch_outcomes_chunk_t *>(
+        branch_outcomes_words(header, header->chunks));
+}
+
+static inline const branch_outcomes_branch_t *
+branch_outcomes_branches(const branch_outcomes_header_t *header)
+{
+    return reinterpret_cast<const branch_outcomes_branch_t *>(
+        branch_outcomes_index(header) + header->chunks);
+}
+
+#endif /* _BRANCH_OUTCOMES_H_ */
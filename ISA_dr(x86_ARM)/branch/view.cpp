@@ -37,16 +37,25 @@
  */
 
 #include "view.h"
+#include "branch_outcomes.h"
 
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <iomanip>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
+#include <vector>
 
 #include "analysis_tool.h"
 #include "dr_api.h"
@@ -61,13 +70,985 @@ namespace dynamorio {
 namespace drmemtrace {
 
 const std::string view_t::TOOL_NAME = "View tool";
-bool zf_cbr = false;
-long zf_taken = 0;
-long zf_untaken = 0;
-long zf_last_addr = 0;
-int zf_last_addr_size=0;
-std::unordered_map<long, std::pair<long, long>> cbrm;
-bool cbrm_inited=false;
+
+// Per-instruction state in an open-addressing table keyed by pc, with linear
+// probing and pc 0 marking an empty slot.  It doubles at 3/4 load, so the
+// steady state does no allocation per instruction.  entry_t is zero-initialized
+// and has a pc field and merge(), used to combine the shards' tables.
+template <typename T> struct pc_table_t {
+    typedef T entry_t;
+    static const size_t INITIAL_SLOTS = 1 << 10;
+
+    pc_table_t()
+        : entries_(INITIAL_SLOTS)
+        , size_(0)
+    {
+    }
+    entry_t &
+    find_or_insert(uint64_t pc)
+    {
+        size_t mask = entries_.size() - 1;
+        for (size_t i = hash(pc) & mask;; i = (i + 1) & mask) {
+            if (entries_[i].pc == pc)
+                return entries_[i];
+            if (entries_[i].pc == 0) {
+                if ((size_ + 1) * 4 > entries_.size() * 3) {
+                    grow();
+                    return find_or_insert(pc);
+                }
+                entries_[i].pc = pc;
+                ++size_;
+                return entries_[i];
+            }
+        }
+    }
+    void
+    merge(const pc_table_t &other)
+    {
+        for (const entry_t &from : other.entries_) {
+            if (from.pc != 0)
+                find_or_insert(from.pc).merge(from);
+        }
+    }
+    // The occupied entries in pc order.
+    std::vector<entry_t>
+    sorted() const
+    {
+        std::vector<entry_t> out;
+        out.reserve(size_);
+        for (const entry_t &entry : entries_) {
+            if (entry.pc != 0)
+                out.push_back(entry);
+        }
+        std::sort(out.begin(), out.end(),
+                  [](const entry_t &a, const entry_t &b) { return a.pc < b.pc; });
+        return out;
+    }
+    size_t
+    size() const
+    {
+        return size_;
+    }
+    size_t
+    slots() const
+    {
+        return entries_.size();
+    }
+    size_t
+    bytes() const
+    {
+        return entries_.size() * sizeof(entry_t);
+    }
+
+private:
+    static size_t
+    hash(uint64_t pc)
+    {
+        // Fibonacci hashing; the high bits are mixed down since the mask keeps
+        // the low ones.
+        uint64_t h = pc * 0x9e3779b97f4a7c15ULL;
+        return static_cast<size_t>(h ^ (h >> 32));
+    }
+    void
+    grow()
+    {
+        std::vector<entry_t> old(entries_.size() * 2);
+        old.swap(entries_);
+        size_ = 0;
+        for (const entry_t &from : old) {
+            if (from.pc != 0)
+                find_or_insert(from.pc) = from;
+        }
+    }
+
+    std::vector<entry_t> entries_;
+    size_t size_;
+};
+
+// Outcome counters of a conditional branch.
+struct branch_entry_t {
+    uint64_t pc;
+    uint64_t taken;
+    uint64_t untaken;
+    // The branch's own recent outcomes, newest in bit 0.
+    uint64_t local_history;
+    // Sums of n*H over the branch's history contexts; see pattern_table_t.
+    double global_cost;
+    double local_cost;
+    // Mispredictions per predictor model; see predictor_bank_t.
+    uint64_t misses[4];
+
+    void
+    merge(const branch_entry_t &from)
+    {
+        taken += from.taken;
+        untaken += from.untaken;
+        global_cost += from.global_cost;
+        local_cost += from.local_cost;
+        for (size_t i = 0; i < sizeof(misses) / sizeof(misses[0]); ++i)
+            misses[i] += from.misses[i];
+    }
+};
+typedef pc_table_t<branch_entry_t> branch_table_t;
+
+// n*log2(n), from a table for the small counts that dominate.
+static double
+xlog2x(uint64_t n)
+{
+    static const size_t TABLE_SIZE = 1 << 12;
+    static const std::vector<double> table = [] {
+        std::vector<double> t(TABLE_SIZE, 0);
+        for (size_t i = 1; i < TABLE_SIZE; ++i)
+            t[i] = i * std::log2(static_cast<double>(i));
+        return t;
+    }();
+    if (n < TABLE_SIZE)
+        return table[n];
+    return n * std::log2(static_cast<double>(n));
+}
+
+// n*H(p) of a context seen taken t and untaken u times, in bits.
+static double
+context_cost(uint64_t t, uint64_t u)
+{
+    return xlog2x(t + u) - xlog2x(t) - xlog2x(u);
+}
+
+// Outcome counts per (branch pc, last k outcomes) context, in a fixed-size
+// hashed table so memory stays bounded however many contexts a trace has.
+// Contexts that hash to a slot held by another are counted together, which
+// can only raise the entropy; the number of such updates is reported.
+//
+// H(outcome | pc, history) is the sum over contexts of n*H(p) divided by the
+// number of branches.  Each update returns how much its context's n*H grew,
+// so the sum, in total and per branch, is kept without walking the table.
+struct pattern_table_t {
+    struct entry_t {
+        uint32_t tag;
+        uint32_t taken;
+        uint32_t untaken;
+    };
+    struct delta_t {
+        double cost;   // Growth of n*H, in bits.
+        double linear; // Growth of n*2*min(p, 1-p).
+    };
+
+    explicit pattern_table_t(int bits)
+        : entries_(static_cast<size_t>(1) << bits)
+        , shift_(64 - bits)
+    {
+    }
+    delta_t
+    update(uint64_t pc, uint64_t history, bool taken)
+    {
+        uint64_t h = (pc * 0x9e3779b97f4a7c15ULL) ^ (history * 0xc2b2ae3d27d4eb4fULL);
+        h ^= h >> 31;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        entry_t &entry = entries_[h >> shift_];
+        uint32_t tag = static_cast<uint32_t>(h) | 1;
+        if (entry.tag == 0) {
+            entry.tag = tag;
+            ++used_;
+        } else if (entry.tag != tag) {
+            ++aliased_;
+        }
+        delta_t delta = { 0, 0 };
+        uint32_t &count = taken ? entry.taken : entry.untaken;
+        if (count == UINT32_MAX)
+            return delta; // Saturated: the context's ratio no longer moves.
+        uint32_t old_min = std::min(entry.taken, entry.untaken);
+        delta.cost = -context_cost(entry.taken, entry.untaken);
+        ++count;
+        delta.cost += context_cost(entry.taken, entry.untaken);
+        delta.linear = 2.0 * (std::min(entry.taken, entry.untaken) - old_min);
+        return delta;
+    }
+    size_t
+    used() const
+    {
+        return used_;
+    }
+    size_t
+    slots() const
+    {
+        return entries_.size();
+    }
+    uint64_t
+    aliased() const
+    {
+        return aliased_;
+    }
+
+private:
+    std::vector<entry_t> entries_;
+    int shift_;
+    size_t used_ = 0;
+    uint64_t aliased_ = 0;
+};
+
+// History lengths (WPC_GHIST_BITS, WPC_LHIST_BITS, up to 64, 0 for off) and the
+// size of each pattern table (2^WPC_HIST_TABLE_BITS entries per shard).
+static int ghist_bits = 0;
+static int lhist_bits = 0;
+static int hist_table_bits = 20;
+
+static uint64_t
+history_mask(int bits)
+{
+    return bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+}
+
+// Branch predictor models, driven by the conditional branches of a shard with
+// that shard's global history (newest outcome in bit 0).  Each has
+// predict(pc, history) and update(pc, history, taken, prediction); update
+// follows the predict for the same branch, so state computed by predict may be
+// reused.  Counters saturate as in hardware.
+
+static inline void
+bump(int8_t &counter, bool up, int8_t min, int8_t max)
+{
+    if (up) {
+        if (counter < max)
+            ++counter;
+    } else if (counter > min) {
+        --counter;
+    }
+}
+
+static inline size_t
+pc_index(uint64_t pc, int bits)
+{
+    return static_cast<size_t>(pc ^ (pc >> bits)) & ((static_cast<size_t>(1) << bits) - 1);
+}
+
+// XORs the low length bits of the history down to bits bits.
+static inline uint64_t
+fold_history(uint64_t history, int length, int bits)
+{
+    history &= history_mask(length);
+    uint64_t folded = 0;
+    for (int i = 0; i < length; i += bits)
+        folded ^= history >> i;
+    return folded & history_mask(bits);
+}
+
+// 2-bit counters indexed by pc, starting weakly not-taken.
+struct bimodal_t {
+    static const char *
+    name()
+    {
+        return "bimodal";
+    }
+    explicit bimodal_t(int bits)
+        : bits_(bits)
+        , counters_(static_cast<size_t>(1) << bits, 1)
+    {
+    }
+    bool
+    predict(uint64_t pc, uint64_t /*history*/)
+    {
+        return counters_[pc_index(pc, bits_)] >= 2;
+    }
+    void
+    update(uint64_t pc, uint64_t /*history*/, bool taken, bool /*prediction*/)
+    {
+        bump(counters_[pc_index(pc, bits_)], taken, 0, 3);
+    }
+    size_t
+    bytes() const
+    {
+        return counters_.size() / 4; // 2 bits each in hardware.
+    }
+
+private:
+    int bits_;
+    std::vector<int8_t> counters_;
+};
+
+// 2-bit counters indexed by pc xor as many global outcomes as index bits,
+// starting weakly not-taken.
+struct gshare_t {
+    static const char *
+    name()
+    {
+        return "gshare";
+    }
+    explicit gshare_t(int bits)
+        : bits_(bits)
+        , counters_(static_cast<size_t>(1) << bits, 1)
+    {
+    }
+    bool
+    predict(uint64_t pc, uint64_t history)
+    {
+        index_ = pc_index(pc ^ (history & history_mask(bits_)), bits_);
+        return counters_[index_] >= 2;
+    }
+    void
+    update(uint64_t /*pc*/, uint64_t /*history*/, bool taken, bool /*prediction*/)
+    {
+        bump(counters_[index_], taken, 0, 3);
+    }
+    size_t
+    bytes() const
+    {
+        return counters_.size() / 4;
+    }
+
+private:
+    int bits_;
+    std::vector<int8_t> counters_;
+    size_t index_ = 0;
+};
+
+// Jimenez and Lin's perceptron predictor: per pc, a bias and one 8-bit weight
+// per global outcome, trained on a misprediction or a low-confidence output.
+struct perceptron_t {
+    static const int HISTORY = 32;
+    static const char *
+    name()
+    {
+        return "perceptron";
+    }
+    explicit perceptron_t(int bits)
+        : bits_(bits)
+        , weights_((static_cast<size_t>(1) << bits) * (HISTORY + 1), 0)
+        , threshold_(static_cast<int>(1.93 * HISTORY + 14))
+    {
+    }
+    bool
+    predict(uint64_t pc, uint64_t history)
+    {
+        row_ = &weights_[pc_index(pc, bits_) * (HISTORY + 1)];
+        output_ = row_[0];
+        for (int i = 0; i < HISTORY; ++i)
+            output_ += (history >> i & 1) ? row_[i + 1] : -row_[i + 1];
+        return output_ >= 0;
+    }
+    void
+    update(uint64_t /*pc*/, uint64_t history, bool taken, bool prediction)
+    {
+        if (prediction == taken && std::abs(output_) > threshold_)
+            return;
+        bump(row_[0], taken, -127, 127);
+        for (int i = 0; i < HISTORY; ++i)
+            bump(row_[i + 1], (history >> i & 1) == taken, -127, 127);
+    }
+    size_t
+    bytes() const
+    {
+        return weights_.size();
+    }
+
+private:
+    int bits_;
+    std::vector<int8_t> weights_;
+    int threshold_;
+    int8_t *row_ = nullptr;
+    int output_ = 0;
+};
+
+// A small TAGE (Seznec and Michaud): a bimodal base and four tagged tables
+// indexed with geometrically longer global histories.  The longest matching
+// table provides the prediction, a newly allocated weak entry defers to the
+// next match, and a misprediction allocates in a longer table.
+struct tage_t {
+    static const int TABLES = 4;
+    static const int TAG_BITS = 9;
+    static const char *
+    name()
+    {
+        return "tage";
+    }
+    explicit tage_t(int bits)
+        : base_(bits)
+        , table_bits_(std::max(bits - 3, 1))
+    {
+        for (int i = 0; i < TABLES; ++i)
+            tables_[i].resize(static_cast<size_t>(1) << table_bits_);
+    }
+    bool
+    predict(uint64_t pc, uint64_t history)
+    {
+        provider_ = -1;
+        alt_ = -1;
+        for (int i = TABLES - 1; i >= 0; --i) {
+            index_[i] = pc_index(pc ^ fold_history(history, LENGTHS[i], table_bits_) ^
+                                     (static_cast<uint64_t>(i) << (table_bits_ - 1)),
+                                 table_bits_);
+            tag_[i] = static_cast<uint16_t>(
+                (pc ^ fold_history(history, LENGTHS[i], TAG_BITS) ^
+                 fold_history(history, LENGTHS[i], TAG_BITS - 1) << 1) &
+                history_mask(TAG_BITS));
+            const entry_t &entry = tables_[i][index_[i]];
+            if (entry.valid && entry.tag == tag_[i]) {
+                if (provider_ < 0)
+                    provider_ = i;
+                else if (alt_ < 0)
+                    alt_ = i;
+            }
+        }
+        base_prediction_ = base_.predict(pc, history);
+        alt_prediction_ = alt_ >= 0 ? tables_[alt_][index_[alt_]].counter >= 0
+                                    : base_prediction_;
+        if (provider_ < 0)
+            return base_prediction_;
+        const entry_t &entry = tables_[provider_][index_[provider_]];
+        provider_prediction_ = entry.counter >= 0;
+        if (entry.useful == 0 && (entry.counter == 0 || entry.counter == -1))
+            return alt_prediction_;
+        return provider_prediction_;
+    }
+    void
+    update(uint64_t pc, uint64_t history, bool taken, bool prediction)
+    {
+        if (provider_ >= 0) {
+            entry_t &entry = tables_[provider_][index_[provider_]];
+            if (provider_prediction_ != alt_prediction_)
+                bump(entry.useful, provider_prediction_ == taken, 0, 3);
+            bump(entry.counter, taken, -4, 3);
+        } else {
+            base_.update(pc, history, taken, base_prediction_);
+        }
+        if (prediction != taken && provider_ < TABLES - 1) {
+            bool allocated = false;
+            for (int i = provider_ + 1; i < TABLES; ++i) {
+                entry_t &entry = tables_[i][index_[i]];
+                if (entry.useful == 0) {
+                    entry.valid = true;
+                    entry.tag = tag_[i];
+                    entry.counter = taken ? 0 : -1;
+                    allocated = true;
+                    break;
+                }
+            }
+            if (!allocated) {
+                for (int i = provider_ + 1; i < TABLES; ++i)
+                    bump(tables_[i][index_[i]].useful, false, 0, 3);
+            }
+        }
+        // Age the useful bits so stale entries can be replaced.
+        if (++updates_ % (static_cast<uint64_t>(256) << table_bits_) == 0) {
+            for (auto &table : tables_) {
+                for (entry_t &entry : table)
+                    entry.useful >>= 1;
+            }
+        }
+    }
+    size_t
+    bytes() const
+    {
+        // Valid bit, 3-bit counter, 2-bit useful and the tag per tagged entry.
+        return base_.bytes() + TABLES * (tables_[0].size() * (1 + 3 + 2 + TAG_BITS) / 8);
+    }
+
+private:
+    // An entry never allocated is invalid, so a computed tag of 0 does not
+    // match it.
+    struct entry_t {
+        bool valid = false;
+        uint16_t tag = 0;
+        int8_t counter = 0;
+        int8_t useful = 0;
+    };
+    static const int LENGTHS[TABLES];
+
+    bimodal_t base_;
+    int table_bits_;
+    std::vector<entry_t> tables_[TABLES];
+    size_t index_[TABLES];
+    uint16_t tag_[TABLES];
+    int provider_ = -1;
+    int alt_ = -1;
+    bool base_prediction_ = false;
+    bool alt_prediction_ = false;
+    bool provider_prediction_ = false;
+    uint64_t updates_ = 0;
+};
+
+const int tage_t::LENGTHS[tage_t::TABLES] = { 5, 12, 27, 64 };
+
+// The models selected by WPC_PREDICTORS, with 2^WPC_PREDICTOR_BITS entries in
+// their main tables.  Each model is a concrete member called through
+// simulate(), so a branch costs no virtual calls.
+enum {
+    PREDICTOR_BIMODAL,
+    PREDICTOR_GSHARE,
+    PREDICTOR_PERCEPTRON,
+    PREDICTOR_TAGE,
+    PREDICTOR_COUNT,
+};
+static const char *const predictor_names[PREDICTOR_COUNT] = {
+    bimodal_t::name(), gshare_t::name(), perceptron_t::name(), tage_t::name()
+};
+static unsigned predictors = 0; // Bit per enabled model.
+static int predictor_bits = 14;
+
+template <typename predictor_t>
+static inline void
+simulate(predictor_t *predictor, uint64_t pc, uint64_t history, bool taken,
+         uint64_t *branch_misses, uint64_t *shard_misses)
+{
+    if (predictor == nullptr)
+        return;
+    bool prediction = predictor->predict(pc, history);
+    predictor->update(pc, history, taken, prediction);
+    *branch_misses += prediction != taken;
+    *shard_misses += prediction != taken;
+}
+
+struct predictor_bank_t {
+    predictor_bank_t()
+    {
+        if (predictors & 1 << PREDICTOR_BIMODAL)
+            bimodal.reset(new bimodal_t(predictor_bits));
+        if (predictors & 1 << PREDICTOR_GSHARE)
+            gshare.reset(new gshare_t(predictor_bits));
+        // The same weight budget as a table of 2^bits bytes.
+        if (predictors & 1 << PREDICTOR_PERCEPTRON)
+            perceptron.reset(new perceptron_t(std::max(predictor_bits - 5, 1)));
+        if (predictors & 1 << PREDICTOR_TAGE)
+            tage.reset(new tage_t(predictor_bits));
+    }
+    void
+    access(uint64_t pc, uint64_t history, bool taken, uint64_t *branch_misses)
+    {
+        simulate(bimodal.get(), pc, history, taken, &branch_misses[PREDICTOR_BIMODAL],
+                 &misses[PREDICTOR_BIMODAL]);
+        simulate(gshare.get(), pc, history, taken, &branch_misses[PREDICTOR_GSHARE],
+                 &misses[PREDICTOR_GSHARE]);
+        simulate(perceptron.get(), pc, history, taken,
+                 &branch_misses[PREDICTOR_PERCEPTRON], &misses[PREDICTOR_PERCEPTRON]);
+        simulate(tage.get(), pc, history, taken, &branch_misses[PREDICTOR_TAGE],
+                 &misses[PREDICTOR_TAGE]);
+    }
+    size_t
+    bytes(int model) const
+    {
+        switch (model) {
+        case PREDICTOR_BIMODAL: return bimodal ? bimodal->bytes() : 0;
+        case PREDICTOR_GSHARE: return gshare ? gshare->bytes() : 0;
+        case PREDICTOR_PERCEPTRON: return perceptron ? perceptron->bytes() : 0;
+        case PREDICTOR_TAGE: return tage ? tage->bytes() : 0;
+        default: return 0;
+        }
+    }
+
+    std::unique_ptr<bimodal_t> bimodal;
+    std::unique_ptr<gshare_t> gshare;
+    std::unique_ptr<perceptron_t> perceptron;
+    std::unique_ptr<tage_t> tage;
+    uint64_t misses[PREDICTOR_COUNT] = {};
+};
+
+// Indirect branch analysis (WPC_INDIRECT): the target each indirect jump, call
+// and return resolves to, taken from the next instruction's address, run
+// through a BTB of WPC_BTB_ENTRIES entries and a return stack buffer of
+// WPC_RSB_DEPTH entries.
+enum {
+    INDIRECT_JUMP,
+    INDIRECT_CALL,
+    INDIRECT_RETURN,
+    INDIRECT_KINDS,
+};
+static const char *const indirect_names[INDIRECT_KINDS] = { "jump", "call", "return" };
+static bool indirect = false;
+static int btb_entries = 4096;
+static int rsb_depth = 16;
+
+// The targets of one indirect site.  Only the first MAX_TARGETS distinct ones
+// are kept, so the state per site is fixed; later ones are counted together.
+struct indirect_site_t {
+    static const int MAX_TARGETS = 8;
+    uint64_t pc;
+    int kind;
+    uint64_t execs;
+    uint64_t hits; // In the BTB, or the RSB for a return.
+    bool overflowed;
+    uint64_t other;
+    struct {
+        uint64_t target;
+        uint64_t count;
+    } targets[MAX_TARGETS];
+
+    void
+    add_target(uint64_t target, uint64_t count)
+    {
+        for (auto &slot : targets) {
+            if (slot.target == target || slot.target == 0) {
+                slot.target = target;
+                slot.count += count;
+                return;
+            }
+        }
+        overflowed = true;
+        other += count;
+    }
+    void
+    merge(const indirect_site_t &from)
+    {
+        kind = from.kind;
+        execs += from.execs;
+        hits += from.hits;
+        for (const auto &slot : from.targets) {
+            if (slot.target != 0)
+                add_target(slot.target, slot.count);
+        }
+        overflowed |= from.overflowed;
+        other += from.other;
+    }
+    int
+    distinct() const
+    {
+        int n = 0;
+        while (n < MAX_TARGETS && targets[n].target != 0)
+            ++n;
+        return n;
+    }
+    // In bits, with the targets past MAX_TARGETS as one, so a lower bound for
+    // sites with more.
+    double
+    entropy() const
+    {
+        double cost = xlog2x(execs) - xlog2x(other);
+        for (const auto &slot : targets)
+            cost -= xlog2x(slot.count);
+        return execs == 0 ? 0 : cost / execs;
+    }
+};
+
+// A 4-way set-associative BTB with LRU replacement, holding the last target of
+// each branch.  A hit needs both the branch and its current target.
+struct btb_t {
+    static const int WAYS = 4;
+    explicit btb_t(int entries)
+    {
+        set_bits_ = 0;
+        while ((2 << set_bits_) * WAYS <= entries)
+            ++set_bits_;
+        ways_.resize((static_cast<size_t>(1) << set_bits_) * WAYS);
+    }
+    bool
+    access(uint64_t pc, uint64_t target)
+    {
+        way_t *set = &ways_[pc_index(pc, set_bits_) * WAYS];
+        way_t *victim = set;
+        ++clock_;
+        for (int i = 0; i < WAYS; ++i) {
+            if (set[i].pc == pc) {
+                bool hit = set[i].target == target;
+                set[i].target = target;
+                set[i].last_use = clock_;
+                return hit;
+            }
+            if (set[i].last_use < victim->last_use)
+                victim = &set[i];
+        }
+        victim->pc = pc;
+        victim->target = target;
+        victim->last_use = clock_;
+        return false;
+    }
+    size_t
+    entries() const
+    {
+        return ways_.size();
+    }
+
+private:
+    struct way_t {
+        uint64_t pc = 0;
+        uint64_t target = 0;
+        uint64_t last_use = 0;
+    };
+    int set_bits_;
+    std::vector<way_t> ways_;
+    uint64_t clock_ = 0;
+};
+
+// A circular return stack buffer: a call pushes its return address, dropping
+// the oldest when full, and a return pops its prediction.
+struct rsb_t {
+    explicit rsb_t(int depth)
+        : stack_(depth)
+    {
+    }
+    void
+    push(uint64_t address)
+    {
+        ++pushes;
+        if (size_ == stack_.size())
+            ++overflows;
+        else
+            ++size_;
+        top_ = (top_ + 1) % stack_.size();
+        stack_[top_] = address;
+    }
+    uint64_t
+    pop()
+    {
+        if (size_ == 0) {
+            ++underflows;
+            return 0;
+        }
+        uint64_t address = stack_[top_];
+        top_ = (top_ + stack_.size() - 1) % stack_.size();
+        --size_;
+        return address;
+    }
+    uint64_t pushes = 0;
+    uint64_t overflows = 0;
+    uint64_t underflows = 0;
+
+private:
+    std::vector<uint64_t> stack_;
+    size_t size_ = 0;
+    size_t top_ = 0;
+};
+
+struct indirect_state_t {
+    indirect_state_t()
+        : btb(btb_entries)
+        , rsb(rsb_depth)
+    {
+    }
+    pc_table_t<indirect_site_t> sites;
+    btb_t btb;
+    rsb_t rsb;
+    // The indirect branch the next instruction resolves.
+    bool pending = false;
+    int pending_kind = 0;
+    uint64_t pending_pc = 0;
+    uint64_t rsb_prediction = 0;
+};
+
+// Outcome streams (WPC_OUTCOME_FILE, WPC_OUTCOME_ORDER): every conditional
+// branch execution as one bit in its branch's stream, written per shard in the
+// format of branch_outcomes.h for offline replay.
+static std::string outcome_path;
+static bool outcome_order = false;
+
+// A branch's counts and partly filled chunk.
+struct outcome_stream_t {
+    uint64_t pc;
+    uint64_t execs;
+    uint64_t taken;
+    uint32_t id;
+    uint32_t bits;
+    uint64_t first;
+    uint64_t words[BRANCH_OUTCOMES_CHUNK_WORDS];
+};
+
+struct outcome_writer_t {
+    outcome_writer_t(int64_t shard)
+        : shard_(static_cast<int32_t>(shard))
+    {
+        std::string path = outcome_path + "." + std::to_string(shard);
+        data_ = fopen(path.c_str(), "wb");
+        if (data_ != NULL && outcome_order)
+            order_ = fopen((path + ".order").c_str(), "wb");
+        if (data_ == NULL || (outcome_order && order_ == NULL)) {
+            error = "Failed to open " + path + (data_ == NULL ? "" : ".order");
+            return;
+        }
+        // The header is rewritten with the counts at the end.
+        branch_outcomes_header_t header;
+        branch_outcomes_header_init(&header, shard_, 0, 0, 0, 0);
+        failed_ = fwrite(&header, sizeof(header), 1, data_) != 1;
+    }
+    ~outcome_writer_t()
+    {
+        if (data_ != NULL)
+            fclose(data_);
+        if (order_ != NULL)
+            fclose(order_);
+    }
+    void
+    record(uint64_t pc, bool taken)
+    {
+        outcome_stream_t &stream = streams_.find_or_insert(pc);
+        if (stream.execs++ == 0)
+            stream.id = static_cast<uint32_t>(streams_.size() - 1);
+        stream.taken += taken;
+        if (stream.bits == 0)
+            stream.first = execs_;
+        stream.words[stream.bits / 64] |= static_cast<uint64_t>(taken) << (stream.bits % 64);
+        if (order_ != NULL)
+            failed_ |= fwrite(&stream.id, sizeof(stream.id), 1, order_) != 1;
+        ++execs_;
+        if (++stream.bits == BRANCH_OUTCOMES_CHUNK_BITS)
+            write_chunk(stream);
+    }
+    // Writes the partly filled chunks, the chunk index and the branch table,
+    // then the header.
+    bool
+    finish(uint64_t instrs)
+    {
+        if (data_ == NULL)
+            return false;
+        std::vector<branch_outcomes_branch_t> branches(streams_.size());
+        for (outcome_stream_t stream : streams_.sorted()) {
+            if (stream.bits > 0)
+                write_chunk(stream);
+            branches[stream.id] = { stream.pc, stream.execs, stream.taken };
+        }
+        failed_ |= fwrite(index_.data(), sizeof(index_[0]), index_.size(), data_) !=
+            index_.size();
+        failed_ |= fwrite(branches.data(), sizeof(branches[0]), branches.size(), data_) !=
+            branches.size();
+        branch_outcomes_header_t header;
+        branch_outcomes_header_init(&header, shard_, index_.size(), branches.size(),
+                                    execs_, instrs);
+        failed_ |= fseek(data_, 0, SEEK_SET) != 0 ||
+            fwrite(&header, sizeof(header), 1, data_) != 1;
+        failed_ |= fclose(data_) != 0;
+        data_ = NULL;
+        if (order_ != NULL) {
+            failed_ |= fclose(order_) != 0;
+            order_ = NULL;
+        }
+        return !failed_;
+    }
+
+    std::string error;
+
+private:
+    void
+    write_chunk(outcome_stream_t &stream)
+    {
+        index_.push_back({ stream.id, stream.bits, stream.first });
+        failed_ |= fwrite(stream.words, sizeof(stream.words), 1, data_) != 1;
+        memset(stream.words, 0, sizeof(stream.words));
+        stream.bits = 0;
+    }
+
+    int32_t shard_; // Thread ids fit in 32 bits.
+    FILE *data_ = NULL;
+    FILE *order_ = NULL;
+    bool failed_ = false;
+    uint64_t execs_ = 0;
+    pc_table_t<outcome_stream_t> streams_;
+    std::vector<branch_outcomes_chunk_t> index_;
+};
+
+// The state of one shard: a thread in the serial mode, a worker's shard in the
+// parallel one.  The pending conditional branch is resolved by the next
+// instruction of the same shard.
+struct branch_shard_t {
+    branch_shard_t(int64_t id, memtrace_stream_t *stream)
+        : id(id)
+        , stream(stream)
+    {
+    }
+    // The shard index in the parallel mode and the thread id in the serial one,
+    // so output names do not depend on the order shards start in.
+    int64_t id;
+    memtrace_stream_t *stream;
+    intptr_t filetype = -1;
+    uint64_t instrs = 0;
+    bool after_cbr = false;
+    uint64_t cbr_pc = 0;
+    unsigned short cbr_size = 0;
+    uint64_t taken = 0;
+    uint64_t untaken = 0;
+    branch_table_t table;
+    // History-conditioned entropy, when enabled.
+    uint64_t global_history = 0;
+    std::unique_ptr<pattern_table_t> global_patterns;
+    std::unique_ptr<pattern_table_t> local_patterns;
+    double global_cost = 0;
+    double global_linear = 0;
+    double local_cost = 0;
+    double local_linear = 0;
+    std::unique_ptr<predictor_bank_t> predictors;
+    std::unique_ptr<indirect_state_t> indirect;
+    std::unique_ptr<outcome_writer_t> outcomes;
+    uint64_t stats_last_usec = 0;
+    uint64_t stats_last_instrs = 0;
+    std::string error;
+};
+
+// view.h is upstream's and declares no members for the branch pass, so its
+// state is kept here.  There is a single view_t per run.
+static std::mutex shard_mutex;
+static std::vector<std::unique_ptr<branch_shard_t>> shards;
+static std::unordered_map<memref_tid_t, branch_shard_t *> serial_shards;
+static memref_tid_t last_serial_tid = -1;
+static branch_shard_t *last_serial_shard = NULL;
+
+// Telemetry (WPC_STATS_MSEC, WPC_STATS_FILE), as in the reuse distance tools:
+// every so many milliseconds a line per shard with the instruction rate, the
+// branch table's size and load and the peak RSS, 0 for never.  The clock is
+// read once per STATS_CHECK_INSTRS instructions of a shard.
+static const uint64_t STATS_CHECK_INSTRS = 1 << 14;
+static uint64_t stats_usec = 0;
+static FILE *stats_file = NULL;
+static std::mutex stats_mutex;
+static std::chrono::steady_clock::time_point stats_start;
+
+static uint64_t
+stats_elapsed_usec()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - stats_start)
+        .count();
+}
+
+static double
+peak_rss_mb()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return usage.ru_maxrss / 1024.0; // Linux reports KB
+}
+
+// Writes a telemetry line for the shard if a period has passed since its last
+// one, or regardless with force.
+static void
+emit_stats(branch_shard_t *shard, bool force)
+{
+    uint64_t now = stats_elapsed_usec();
+    if (!force && now - shard->stats_last_usec < stats_usec)
+        return;
+    double seconds = (now - shard->stats_last_usec) / 1e6;
+    std::lock_guard<std::mutex> guard(stats_mutex);
+    fprintf(stats_file,
+            "stats shard %lld time %.3f instrs %llu instrs/sec %.0f cbrs %llu "
+            "branches %zu load %.2f table_mb %.1f peak_rss_mb %.1f\n",
+            (long long)shard->id, now / 1e6, (unsigned long long)shard->instrs,
+            seconds > 0 ? (shard->instrs - shard->stats_last_instrs) / seconds : 0.0,
+            (unsigned long long)(shard->taken + shard->untaken), shard->table.size(),
+            (double)shard->table.size() / shard->table.slots(),
+            shard->table.bytes() / 1048576.0, peak_rss_mb());
+    fflush(stats_file);
+    shard->stats_last_usec = now;
+    shard->stats_last_instrs = shard->instrs;
+}
+
+static branch_shard_t *
+register_shard(int64_t id, memtrace_stream_t *stream)
+{
+    std::lock_guard<std::mutex> guard(shard_mutex);
+    shards.emplace_back(new branch_shard_t(id, stream));
+    branch_shard_t *shard = shards.back().get();
+    if (ghist_bits > 0)
+        shard->global_patterns.reset(new pattern_table_t(hist_table_bits));
+    if (lhist_bits > 0)
+        shard->local_patterns.reset(new pattern_table_t(hist_table_bits));
+    if (predictors != 0)
+        shard->predictors.reset(new predictor_bank_t);
+    if (indirect)
+        shard->indirect.reset(new indirect_state_t);
+    if (!outcome_path.empty()) {
+        shard->outcomes.reset(new outcome_writer_t(shard->id));
+        if (!shard->outcomes->error.empty()) {
+            std::cerr << shard->outcomes->error << ": outcome streams disabled\n";
+            shard->outcomes.reset();
+        }
+    }
+    return shard;
+}
 
 analysis_tool_t *
 view_tool_create(const std::string &module_file_path, uint64_t skip_refs,
@@ -77,20 +1058,6 @@ view_tool_create(const std::string &module_file_path, uint64_t skip_refs,
     return new view_t(module_file_path, skip_refs, sim_refs, syntax, verbose,
                       alt_module_dir);
 }
-inline void updateCBRM(long ins_id, bool taken) {
-    if (!cbrm_inited){
-	cbrm.clear();
-        cbrm_inited=true;
-        std::cout << "[INFO: cbrm initialized" << "]\n";
-    }	
-    auto iter = cbrm.find(ins_id);
-    if (iter == cbrm.end()) {
-        cbrm[ins_id] = std::make_pair(taken, !taken);
-    } else {
-        iter->second.first += taken;
-        iter->second.second += !taken;
-    }
-}
 
 view_t::view_t(const std::string &module_file_path, uint64_t skip_refs, uint64_t sim_refs,
                const std::string &syntax, unsigned int verbose,
@@ -110,6 +1077,56 @@ view_t::view_t(const std::string &module_file_path, uint64_t skip_refs, uint64_t
     , timestamp_(0)
     , has_modules_(true)
 {
+    const char *stats_msec = getenv("WPC_STATS_MSEC");
+    stats_usec = stats_msec == NULL ? 0 : strtoull(stats_msec, NULL, 0) * 1000;
+    if (stats_usec > 0) {
+        const char *path = getenv("WPC_STATS_FILE");
+        stats_file = path == NULL || *path == '\0' ? stderr : fopen(path, "w");
+        if (stats_file == NULL) {
+            std::cerr << "Failed to open " << path << ": telemetry disabled\n";
+            stats_usec = 0;
+        }
+        stats_start = std::chrono::steady_clock::now();
+    }
+    const char *bits = getenv("WPC_GHIST_BITS");
+    ghist_bits = bits == NULL ? 0 : std::min(atoi(bits), 64);
+    bits = getenv("WPC_LHIST_BITS");
+    lhist_bits = bits == NULL ? 0 : std::min(atoi(bits), 64);
+    bits = getenv("WPC_HIST_TABLE_BITS");
+    if (bits != NULL)
+        hist_table_bits = std::max(1, std::min(atoi(bits), 32));
+    bits = getenv("WPC_PREDICTOR_BITS");
+    if (bits != NULL)
+        predictor_bits = std::max(6, std::min(atoi(bits), 28));
+    const char *list = getenv("WPC_PREDICTORS");
+    if (list != NULL) {
+        std::string names = std::string(list) + ",";
+        for (size_t start = 0, end; (end = names.find(',', start)) != std::string::npos;
+             start = end + 1) {
+            std::string name = names.substr(start, end - start);
+            int model = 0;
+            while (model < PREDICTOR_COUNT && name != predictor_names[model])
+                ++model;
+            if (name == "all")
+                predictors = (1 << PREDICTOR_COUNT) - 1;
+            else if (model < PREDICTOR_COUNT)
+                predictors |= 1 << model;
+            else if (!name.empty())
+                std::cerr << "Unknown predictor " << name << " in WPC_PREDICTORS\n";
+        }
+    }
+    const char *value = getenv("WPC_INDIRECT");
+    indirect = value != NULL && atoi(value) != 0;
+    value = getenv("WPC_BTB_ENTRIES");
+    if (value != NULL)
+        btb_entries = std::max(atoi(value), btb_t::WAYS);
+    value = getenv("WPC_RSB_DEPTH");
+    if (value != NULL)
+        rsb_depth = std::max(atoi(value), 1);
+    value = getenv("WPC_OUTCOME_FILE");
+    outcome_path = value == NULL ? "" : value;
+    value = getenv("WPC_OUTCOME_ORDER");
+    outcome_order = value != NULL && atoi(value) != 0;
 }
 
 std::string
@@ -158,28 +1175,28 @@ view_t::initialize_stream(memtrace_stream_t *serial_stream)
 bool
 view_t::parallel_shard_supported()
 {
-    return false;
+    // -skip_refs and -sim_refs count records across the whole trace.
+    return knob_skip_refs_ == 0 && knob_sim_refs_ == 0;
 }
 
 void *
 view_t::parallel_shard_init_stream(int shard_index, void *worker_data,
                                    memtrace_stream_t *shard_stream)
 {
-    return shard_stream;
+    return register_shard(shard_index, shard_stream);
 }
 
 bool
 view_t::parallel_shard_exit(void *shard_data)
 {
+    // The shard is kept for print_results.
     return true;
 }
 
 std::string
 view_t::parallel_shard_error(void *shard_data)
 {
-    // Our parallel operation ignores all but one thread, so we need just
-    // the one global error string.
-    return error_string_;
+    return reinterpret_cast<branch_shard_t *>(shard_data)->error;
 }
 
 bool
@@ -209,48 +1226,71 @@ view_t::should_skip(memtrace_stream_t *memstream, const memref_t &memref)
 bool
 view_t::process_memref(const memref_t &memref)
 {
-    return parallel_shard_memref(serial_stream_, memref);
+    // Each thread gets its own shard, so a branch is resolved by the next
+    // instruction of its own thread even when threads are interleaved.
+    if (memref.instr.tid != last_serial_tid || last_serial_shard == NULL) {
+        branch_shard_t *&shard = serial_shards[memref.instr.tid];
+        if (shard == NULL)
+            shard = register_shard(memref.instr.tid, serial_stream_);
+        last_serial_tid = memref.instr.tid;
+        last_serial_shard = shard;
+    }
+    if (!parallel_shard_memref(last_serial_shard, memref)) {
+        error_string_ = last_serial_shard->error;
+        return false;
+    }
+    return true;
 }
+
 bool
 view_t::parallel_shard_memref(void *shard_data, const memref_t &memref)
 {
-    memtrace_stream_t *memstream = reinterpret_cast<memtrace_stream_t *>(shard_data);
+    branch_shard_t *shard = reinterpret_cast<branch_shard_t *>(shard_data);
+    memtrace_stream_t *memstream = shard->stream;
     // Even for -skip_refs we need to process the up-front version and type.
     if (memref.marker.type == TRACE_TYPE_MARKER) {
         switch (memref.marker.marker_type) {
-        case TRACE_MARKER_TYPE_VERSION:
+        case TRACE_MARKER_TYPE_VERSION: {
             // We delay printing until we know the tid.
+            std::lock_guard<std::mutex> guard(shard_mutex);
             if (trace_version_ == -1) {
                 trace_version_ = static_cast<int>(memref.marker.marker_value);
             } else if (trace_version_ != static_cast<int>(memref.marker.marker_value)) {
-                error_string_ = std::string("Version mismatch across files");
+                shard->error = std::string("Version mismatch across files");
                 return false;
             }
             version_record_ord_ = memstream->get_record_ordinal();
             return true; // Do not count toward -sim_refs yet b/c we don't have tid.
-        case TRACE_MARKER_TYPE_FILETYPE:
+        }
+        case TRACE_MARKER_TYPE_FILETYPE: {
             // We delay printing until we know the tid.
+            std::lock_guard<std::mutex> guard(shard_mutex);
             if (filetype_ == -1) {
                 filetype_ = static_cast<intptr_t>(memref.marker.marker_value);
             } else if (filetype_ != static_cast<intptr_t>(memref.marker.marker_value)) {
-                error_string_ = std::string("Filetype mismatch across files");
+                shard->error = std::string("Filetype mismatch across files");
                 return false;
             }
+            shard->filetype = filetype_;
             filetype_record_ord_ = memstream->get_record_ordinal();
             if (TESTANY(OFFLINE_FILE_TYPE_ARCH_ALL, memref.marker.marker_value) &&
                 !TESTANY(build_target_arch_type(), memref.marker.marker_value)) {
-                error_string_ = std::string("Architecture mismatch: trace recorded on ") +
+                shard->error = std::string("Architecture mismatch: trace recorded on ") +
                     trace_arch_string(static_cast<offline_file_type_t>(
                         memref.marker.marker_value)) +
                     " but tool built for " + trace_arch_string(build_target_arch_type());
                 return false;
             }
             return true; // Do not count toward -sim_refs yet b/c we don't have tid.
+        }
         case TRACE_MARKER_TYPE_TIMESTAMP:
             // Delay to see whether this is a new window.  We assume a timestamp
             // is always followed by another marker (cpu or window).
             // We can't easily reorder and place window markers before timestamps
             // since memref iterators use the timestamps to order buffer units.
+            // Only -skip_refs and -sim_refs, which are serial, use it.
+            if (knob_skip_refs_ == 0 && knob_sim_refs_ == 0)
+                return true;
             timestamp_ = memref.marker.marker_value;
             timestamp_record_ord_ = memstream->get_record_ordinal();
             if (should_skip(memstream, memref))
@@ -278,6 +1318,9 @@ view_t::parallel_shard_memref(void *shard_data, const memref_t &memref)
         return true;
     }
 
+    if (stats_usec > 0 && shard->instrs > 0 && shard->instrs % STATS_CHECK_INSTRS == 0)
+        emit_stats(shard, false);
+
    // static constexpr int name_width = 12;
 
     //if (zf_cbr){
@@ -288,20 +1331,52 @@ view_t::parallel_shard_memref(void *shard_data, const memref_t &memref)
         //      << std::dec << std::setfill(' ');
     //}
 
-    if(zf_cbr){
-    long zf_next_addr_p = zf_last_addr + zf_last_addr_size;
-    long zf_next_addr_y = std::stol(std::to_string(memref.instr.addr));
-    if(zf_next_addr_p == zf_next_addr_y){
-	    updateCBRM(zf_last_addr,true);
-	    zf_taken +=1;
-            //std::cerr<<"taken: "<< zf_taken <<","<< zf_last_addr<<"," << zf_last_addr_size<<"," <<memref.instr.addr<<"\n";
-    }else{
-	    updateCBRM(zf_last_addr,false);
-	    zf_untaken +=1;
-	    //std::cerr<<"untaken: "<< zf_untaken<<"," << zf_last_addr<<"," << zf_last_addr_size<<"," <<memref.instr.addr<<"\n";
+    if (shard->after_cbr) {
+        // A conditional branch was taken unless control fell through to the next
+        // instruction.
+        bool taken = memref.instr.addr != shard->cbr_pc + shard->cbr_size;
+        branch_entry_t &entry = shard->table.find_or_insert(shard->cbr_pc);
+        entry.taken += taken;
+        entry.untaken += !taken;
+        shard->taken += taken;
+        shard->untaken += !taken;
+        if (shard->global_patterns) {
+            pattern_table_t::delta_t delta = shard->global_patterns->update(
+                shard->cbr_pc, shard->global_history & history_mask(ghist_bits), taken);
+            entry.global_cost += delta.cost;
+            shard->global_cost += delta.cost;
+            shard->global_linear += delta.linear;
+        }
+        if (shard->local_patterns) {
+            pattern_table_t::delta_t delta = shard->local_patterns->update(
+                shard->cbr_pc, entry.local_history & history_mask(lhist_bits), taken);
+            entry.local_cost += delta.cost;
+            shard->local_cost += delta.cost;
+            shard->local_linear += delta.linear;
+            entry.local_history = entry.local_history << 1 | taken;
+        }
+        if (shard->predictors) {
+            shard->predictors->access(shard->cbr_pc, shard->global_history, taken,
+                                      entry.misses);
+        }
+        if (shard->outcomes)
+            shard->outcomes->record(shard->cbr_pc, taken);
+        shard->global_history = shard->global_history << 1 | taken;
     }
+    if (shard->indirect && shard->indirect->pending) {
+        indirect_state_t &state = *shard->indirect;
+        uint64_t target = memref.instr.addr;
+        indirect_site_t &site = state.sites.find_or_insert(state.pending_pc);
+        site.kind = state.pending_kind;
+        ++site.execs;
+        site.add_target(target, 1);
+        if (state.pending_kind == INDIRECT_RETURN)
+            site.hits += state.rsb_prediction == target;
+        else
+            site.hits += state.btb.access(state.pending_pc, target);
+        state.pending = false;
     }
-    if (!TESTANY(OFFLINE_FILE_TYPE_ENCODINGS, filetype_) && !has_modules_) {
+    if (!TESTANY(OFFLINE_FILE_TYPE_ENCODINGS, shard->filetype) && !has_modules_) {
         // We can't disassemble so we provide what info the trace itself contains.
         // XXX i#5486: We may want to store the taken target for conditional
         // branches; if added, we can print it here.
@@ -312,7 +1387,13 @@ view_t::parallel_shard_memref(void *shard_data, const memref_t &memref)
         switch (memref.instr.type) {
         case TRACE_TYPE_INSTR: break;//std::cerr << "non-branch\n"; break;
         case TRACE_TYPE_INSTR_DIRECT_JUMP: break;// std::cerr << "jump\n"; break;
-        case TRACE_TYPE_INSTR_INDIRECT_JUMP: break; //std::cerr << "indirect jump\n"; break;
+        case TRACE_TYPE_INSTR_INDIRECT_JUMP: //std::cerr << "indirect jump\n";
+            if (shard->indirect) {
+                shard->indirect->pending = true;
+                shard->indirect->pending_kind = INDIRECT_JUMP;
+                shard->indirect->pending_pc = memref.instr.addr;
+            }
+            break;
         case TRACE_TYPE_INSTR_CONDITIONAL_JUMP:
           //  if (!zf_cbr){
 	    //print_prefix(memstream, memref);
@@ -322,68 +1403,266 @@ view_t::parallel_shard_memref(void *shard_data, const memref_t &memref)
 	//	      << std::dec << std::setfill(' ');
 	    //}
 	    //std::cerr << " conditional jump\n";
-	    zf_last_addr = std::stol(std::to_string(memref.instr.addr));
-	    zf_last_addr_size = memref.instr.size;
+	    shard->cbr_pc = memref.instr.addr;
+	    shard->cbr_size = static_cast<unsigned short>(memref.instr.size);
 	    break;
         case TRACE_TYPE_INSTR_TAKEN_JUMP: break;//std::cerr << "taken conditional jump\n"; break;
         case TRACE_TYPE_INSTR_UNTAKEN_JUMP:
             //std::cerr << "untaken conditional jump\n";
             break;
-        case TRACE_TYPE_INSTR_DIRECT_CALL: break;// std::cerr << "call\n"; break;
-        case TRACE_TYPE_INSTR_INDIRECT_CALL: break;// std::cerr << "indirect call\n"; break;
-        case TRACE_TYPE_INSTR_RETURN: break;//std::cerr << "return\n"; break;
+        case TRACE_TYPE_INSTR_DIRECT_CALL: // std::cerr << "call\n";
+            if (shard->indirect)
+                shard->indirect->rsb.push(memref.instr.addr + memref.instr.size);
+            break;
+        case TRACE_TYPE_INSTR_INDIRECT_CALL: // std::cerr << "indirect call\n";
+            if (shard->indirect) {
+                shard->indirect->pending = true;
+                shard->indirect->pending_kind = INDIRECT_CALL;
+                shard->indirect->pending_pc = memref.instr.addr;
+                shard->indirect->rsb.push(memref.instr.addr + memref.instr.size);
+            }
+            break;
+        case TRACE_TYPE_INSTR_RETURN: //std::cerr << "return\n";
+            if (shard->indirect) {
+                shard->indirect->pending = true;
+                shard->indirect->pending_kind = INDIRECT_RETURN;
+                shard->indirect->pending_pc = memref.instr.addr;
+                shard->indirect->rsb_prediction = shard->indirect->rsb.pop();
+            }
+            break;
         case TRACE_TYPE_INSTR_NO_FETCH: break;//std::cerr << "non-fetched instruction\n"; break;
         case TRACE_TYPE_INSTR_SYSENTER: break;//std::cerr << "sysenter\n"; break;
-        default: error_string_ = "Unknown instruction type\n"; return false;
+        default: shard->error = "Unknown instruction type\n"; return false;
         }
 	//if (zf_cbr){
 	  //  std::cerr <<"\n";
 	//}
-	zf_cbr = (memref.instr.type == TRACE_TYPE_INSTR_CONDITIONAL_JUMP);
-        ++num_disasm_instrs_;
+	shard->after_cbr = (memref.instr.type == TRACE_TYPE_INSTR_CONDITIONAL_JUMP);
+        ++shard->instrs;
         return true;
     }
 
     app_pc decode_pc;
     const app_pc orig_pc = (app_pc)memref.instr.addr;
-    if (!TESTANY(OFFLINE_FILE_TYPE_ENCODINGS, filetype_)) {
-        // Legacy trace support where we need the binaries.
+    if (!TESTANY(OFFLINE_FILE_TYPE_ENCODINGS, shard->filetype)) {
+        // Legacy trace support where we need the binaries.  The mapper is
+        // shared by all shards.
+        std::lock_guard<std::mutex> guard(shard_mutex);
         decode_pc = module_mapper_->find_mapped_trace_address(orig_pc);
         if (!module_mapper_->get_last_error().empty()) {
-            error_string_ = "Failed to find mapped address for " +
+            shard->error = "Failed to find mapped address for " +
                 to_hex_string(memref.instr.addr) + ": " +
                 module_mapper_->get_last_error();
             return false;
         }
     }
 
-    ++num_disasm_instrs_;
+    ++shard->instrs;
     return true;
 }
 
-inline double linear_entropy(long taken, long untaken) {
+inline double linear_entropy(uint64_t taken, uint64_t untaken) {
     double p = (double) taken / (taken + untaken);
     double ret = 2.0 *std::min(p, 1-p);
     return ret;
 }
+// Entropy of each branch given the last k global or local outcomes, next to
+// its plain (bias-only) entropy.  All in bits per execution.
+static void
+print_history_results(const branch_table_t &cbrm, uint64_t cbrs)
+{
+    double bias_cost = 0;
+    double global_cost = 0, global_linear = 0, local_cost = 0, local_linear = 0;
+    size_t global_used = 0, global_slots = 0, local_used = 0, local_slots = 0;
+    uint64_t global_aliased = 0, local_aliased = 0;
+    for (const auto &shard : shards) {
+        global_cost += shard->global_cost;
+        global_linear += shard->global_linear;
+        local_cost += shard->local_cost;
+        local_linear += shard->local_linear;
+        if (shard->global_patterns) {
+            global_used += shard->global_patterns->used();
+            global_slots += shard->global_patterns->slots();
+            global_aliased += shard->global_patterns->aliased();
+        }
+        if (shard->local_patterns) {
+            local_used += shard->local_patterns->used();
+            local_slots += shard->local_patterns->slots();
+            local_aliased += shard->local_patterns->aliased();
+        }
+    }
+    for (const auto &count : cbrm.sorted()) {
+        uint64_t n = count.taken + count.untaken;
+        double bias = context_cost(count.taken, count.untaken);
+        bias_cost += bias;
+        std::cout << "hist:" << count.pc << ": bias " << bias / n;
+        if (ghist_bits > 0)
+            std::cout << ", global " << count.global_cost / n;
+        if (lhist_bits > 0)
+            std::cout << ", local " << count.local_cost / n;
+        std::cout << "\n";
+    }
+    std::cerr << "branch entropy (bits): " << bias_cost / cbrs << "\n";
+    if (ghist_bits > 0) {
+        std::cerr << "branch entropy given " << ghist_bits
+                  << " global outcomes (bits): " << global_cost / cbrs
+                  << ", linear entropy: " << global_linear / cbrs << "\n";
+        std::cerr << "global pattern table: " << global_used << " of " << global_slots
+                  << " entries used, " << global_aliased << " aliased updates\n";
+    }
+    if (lhist_bits > 0) {
+        std::cerr << "branch entropy given " << lhist_bits
+                  << " local outcomes (bits): " << local_cost / cbrs
+                  << ", linear entropy: " << local_linear / cbrs << "\n";
+        std::cerr << "local pattern table: " << local_used << " of " << local_slots
+                  << " entries used, " << local_aliased << " aliased updates\n";
+    }
+}
+
+// Mispredictions of each model, as MPKI and accuracy over the whole trace and
+// as counts per branch.
+static void
+print_predictor_results(const branch_table_t &cbrm, uint64_t cbrs, uint64_t instrs)
+{
+    for (int model = 0; model < PREDICTOR_COUNT; ++model) {
+        if (!(predictors & 1 << model))
+            continue;
+        uint64_t misses = 0;
+        size_t bytes = 0;
+        for (const auto &shard : shards) {
+            if (shard->predictors) {
+                misses += shard->predictors->misses[model];
+                bytes = shard->predictors->bytes(model);
+            }
+        }
+        std::cerr << "predictor " << predictor_names[model] << " (" << bytes / 1024.0
+                  << " KB): " << misses << " mispredictions, MPKI "
+                  << 1000.0 * misses / instrs << ", accuracy "
+                  << 100.0 * (cbrs - misses) / cbrs << "%\n";
+    }
+    for (const auto &count : cbrm.sorted()) {
+        std::cout << "pred:" << count.pc << ":";
+        const char *sep = " ";
+        for (int model = 0; model < PREDICTOR_COUNT; ++model) {
+            if (!(predictors & 1 << model))
+                continue;
+            std::cout << sep << predictor_names[model] << " " << count.misses[model];
+            sep = ", ";
+        }
+        std::cout << "\n";
+    }
+}
+
+// Per kind of indirect branch: executions, sites, the hit rate in the BTB (the
+// RSB for returns) and the execution-weighted target entropy, then how many
+// jump and call sites have how many targets, then a line per site.
+static void
+print_indirect_results()
+{
+    pc_table_t<indirect_site_t> sites;
+    uint64_t pushes = 0, overflows = 0, underflows = 0;
+    for (const auto &shard : shards) {
+        if (!shard->indirect)
+            continue;
+        sites.merge(shard->indirect->sites);
+        pushes += shard->indirect->rsb.pushes;
+        overflows += shard->indirect->rsb.overflows;
+        underflows += shard->indirect->rsb.underflows;
+    }
+    std::vector<indirect_site_t> sorted = sites.sorted();
+    uint64_t execs[INDIRECT_KINDS] = {}, hits[INDIRECT_KINDS] = {};
+    uint64_t site_count[INDIRECT_KINDS] = {};
+    double cost[INDIRECT_KINDS] = {};
+    // Sites with 1, 2, 3-4, 5-8 and more than 8 targets.
+    uint64_t by_targets[5] = {};
+    for (const auto &site : sorted) {
+        execs[site.kind] += site.execs;
+        hits[site.kind] += site.hits;
+        ++site_count[site.kind];
+        cost[site.kind] += site.entropy() * site.execs;
+        if (site.kind == INDIRECT_RETURN)
+            continue;
+        int n = site.distinct();
+        ++by_targets[site.overflowed ? 4 : n <= 2 ? n - 1 : n <= 4 ? 2 : 3];
+    }
+    for (int kind = 0; kind < INDIRECT_KINDS; ++kind) {
+        std::cerr << "indirect " << indirect_names[kind] << ": " << execs[kind]
+                  << " executions at " << site_count[kind] << " sites, "
+                  << (kind == INDIRECT_RETURN ? "RSB" : "BTB") << " hit rate "
+                  << (execs[kind] == 0 ? 0.0 : 100.0 * hits[kind] / execs[kind])
+                  << "%, target entropy (bits) "
+                  << (execs[kind] == 0 ? 0.0 : cost[kind] / execs[kind]) << "\n";
+    }
+    std::cerr << "indirect jump and call sites by targets: 1: " << by_targets[0]
+              << ", 2: " << by_targets[1] << ", 3-4: " << by_targets[2]
+              << ", 5-8: " << by_targets[3] << ", >8: " << by_targets[4] << "\n";
+    std::cerr << "BTB " << (shards.empty() || !shards[0]->indirect
+                                ? 0
+                                : shards[0]->indirect->btb.entries())
+              << " entries, RSB " << rsb_depth << " entries: " << pushes << " calls, "
+              << overflows << " overflows ("
+              << (pushes == 0 ? 0.0 : 100.0 * overflows / pushes) << "%), "
+              << underflows << " underflows\n";
+    for (const auto &site : sorted) {
+        std::cout << "ind:" << site.pc << ": " << indirect_names[site.kind] << ", execs "
+                  << site.execs << ", targets " << site.distinct()
+                  << (site.overflowed ? "+" : "") << ", entropy " << site.entropy()
+                  << ", hits " << site.hits << "\n";
+    }
+}
+
 bool
 view_t::print_results()
 {
+    uint64_t print_start = 0;
+    if (stats_usec > 0) {
+        for (const auto &shard : shards)
+            emit_stats(shard.get(), true);
+        print_start = stats_elapsed_usec();
+    }
+    branch_table_t cbrm;
+    uint64_t zf_taken = 0;
+    uint64_t zf_untaken = 0;
+    num_disasm_instrs_ = 0;
+    for (const auto &shard : shards) {
+        cbrm.merge(shard->table);
+        zf_taken += shard->taken;
+        zf_untaken += shard->untaken;
+        num_disasm_instrs_ += shard->instrs;
+    }
     std::cerr << TOOL_NAME << " results:\n";
     std::cerr << std::setw(15) << num_disasm_instrs_ << " : total instructions\n";
-    long zf_cbrn = zf_taken + zf_untaken;
+    uint64_t zf_cbrn = zf_taken + zf_untaken;
     std::cerr << zf_cbrn<< ": total cbr instructions, "<< zf_taken<<" :taken\n";
 
     double weighted_linear_entropy = 0.0;
-        for (auto& kv : cbrm) {
-            auto& count = kv.second;
+        for (const auto &count : cbrm.sorted()) {
 	    weighted_linear_entropy +=
-                (count.first + count.second) * linear_entropy(count.first, count.second);
-            // std::cout << "linear_entropy: " << linear_entropy(count.first, count.second) << std::endl;
-            std::cout<<"kv:" <<kv.first<<": "<< count.first << ", " << count.second <<"\n";
+                (count.taken + count.untaken) * linear_entropy(count.taken, count.untaken);
+            // std::cout << "linear_entropy: " << linear_entropy(count.taken, count.untaken) << std::endl;
+            std::cout<<"kv:" <<count.pc<<": "<< count.taken << ", " << count.untaken <<"\n";
         }
         weighted_linear_entropy /= zf_cbrn;
     std::cerr <<"branch linear entropy: "<<weighted_linear_entropy<<"\n";
+    if (ghist_bits > 0 || lhist_bits > 0)
+        print_history_results(cbrm, zf_cbrn);
+    if (predictors != 0)
+        print_predictor_results(cbrm, zf_cbrn, num_disasm_instrs_);
+    if (indirect)
+        print_indirect_results();
+    for (const auto &shard : shards) {
+        if (shard->outcomes && !shard->outcomes->finish(shard->instrs)) {
+            std::cerr << "Failed to write the outcome streams of shard " << shard->id
+                      << "\n";
+        }
+    }
+    if (stats_usec > 0) {
+        fprintf(stats_file, "stats print_results seconds %.3f peak_rss_mb %.1f\n",
+                (stats_elapsed_usec() - print_start) / 1e6, peak_rss_mb());
+        if (stats_file != stderr)
+            fclose(stats_file);
+        stats_usec = 0;
+    }
     return true;
 }
 
@@ -0,0 +1,376 @@
+/* reuse_result: query and merge the binary results of the reuse distance tools.
+ *
+ *   reuse_result query [-shards] FILE...
+ *       One line per aggregate (per record with -shards) with its counters and
+ *       distance and reuse time statistics.
+ *   reuse_result merge -o OUT FILE...
+ *       Writes OUT with, for each granularity, the sum of the inputs'
+ *       aggregates followed by each input's aggregate as shard 0, 1, ... in
+ *       input order.
+ *
+ * Files are mapped rather than read and only the aggregates are touched, so
+ * thousands of files take a few seconds at most.
+ *
+ * g++ -O2 -std=c++11 reuse_result.cpp -o reuse_result
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "reuse_result.h"
+
+/* A read-only mapping of one result file. */
+struct mapped_result_t {
+    mapped_result_t()
+        : data_(NULL)
+        , size_(0)
+        , header_(NULL)
+    {
+    }
+
+    ~mapped_result_t()
+    {
+        if (data_ != NULL)
+            munmap(data_, size_);
+    }
+
+    bool
+    open(const char *path, std::string *error)
+    {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            *error = strerror(errno);
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            *error = strerror(errno);
+            close(fd);
+            return false;
+        }
+        size_ = st.st_size;
+        if (size_ > 0)
+            data_ = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data_ == MAP_FAILED) {
+            data_ = NULL;
+            *error = strerror(errno);
+            return false;
+        }
+        header_ = reuse_result_check(data_ == NULL ? "" : data_, size_, error);
+        return header_ != NULL;
+    }
+
+    const reuse_result_header_t *
+    header() const
+    {
+        return header_;
+    }
+
+private:
+    mapped_result_t(const mapped_result_t &);
+    mapped_result_t &
+    operator=(const mapped_result_t &);
+
+    void *data_;
+    size_t size_;
+    const reuse_result_header_t *header_;
+};
+
+static void
+usage()
+{
+    fprintf(stderr,
+            "usage: reuse_result query [-shards] FILE...\n"
+            "       reuse_result merge -o OUT FILE...\n");
+}
+
+static double
+mean(__uint128_t sum, uint64_t count)
+{
+    return count == 0 ? 0. : static_cast<double>(sum) / count;
+}
+
+static double
+stddev(__uint128_t sum, __uint128_t sqsum, uint64_t count)
+{
+    if (count == 0)
+        return 0.;
+    double mean_value = mean(sum, count);
+    double variance = static_cast<double>(sqsum) / count - mean_value * mean_value;
+    return std::sqrt(std::max(variance, 0.));
+}
+
+static void
+print_record(const char *path, const reuse_result_header_t *header,
+             const reuse_result_record_t *record)
+{
+    const uint64_t *dist_hist = reuse_result_dist_hist(record);
+    printf("%s\t%lld\t%llu\t%llu\t%llu\t%llu\t%.2f\t%llu\t%llu\t%llu\t%f\t%f\n", path,
+           static_cast<long long>(record->shard),
+           static_cast<unsigned long long>(record->line_bits),
+           static_cast<unsigned long long>(record->total_refs),
+           static_cast<unsigned long long>(record->unique_lines),
+           static_cast<unsigned long long>(record->dist_count),
+           // Like the text output, a reuse at distance d counts as d + 1 lines.
+           mean(reuse_result_get128(record->dist_sum) + record->dist_count,
+                record->dist_count),
+           static_cast<unsigned long long>(
+               reuse_result_percentile(header, dist_hist, record->dist_count, 0.5)),
+           static_cast<unsigned long long>(
+               reuse_result_percentile(header, dist_hist, record->dist_count, 0.9)),
+           static_cast<unsigned long long>(
+               reuse_result_percentile(header, dist_hist, record->dist_count, 0.99)),
+           mean(reuse_result_get128(record->time_sum), record->time_count),
+           stddev(reuse_result_get128(record->time_sum),
+                  reuse_result_get128(record->time_sqsum), record->time_count));
+}
+
+static int
+query(int argc, char **argv)
+{
+    bool shards = false;
+    int first = 0;
+    if (first < argc && strcmp(argv[first], "-shards") == 0) {
+        shards = true;
+        ++first;
+    }
+    if (first == argc) {
+        usage();
+        return 1;
+    }
+    // The time columns are what the text output calls "the mean/stdev of
+    // reuse dist is".
+    printf("file\tshard\tline_bits\ttotal_refs\tunique_lines\treuses\tdist_mean\t"
+           "dist_p50\tdist_p90\tdist_p99\ttime_mean\ttime_stdev\n");
+    int status = 0;
+    for (int i = first; i < argc; ++i) {
+        mapped_result_t result;
+        std::string error;
+        if (!result.open(argv[i], &error)) {
+            fprintf(stderr, "%s: %s\n", argv[i], error.c_str());
+            status = 1;
+            continue;
+        }
+        const reuse_result_header_t *header = result.header();
+        for (uint32_t r = 0; r < header->records; ++r) {
+            const reuse_result_record_t *record = reuse_result_record(header, r);
+            if (shards || record->shard < 0)
+                print_record(argv[i], header, record);
+        }
+    }
+    return status;
+}
+
+static void
+add_record(const reuse_result_header_t *header, const reuse_result_record_t *from,
+           reuse_result_record_t *to)
+{
+    to->total_refs += from->total_refs;
+    to->unique_accesses += from->unique_accesses;
+    to->unique_lines += from->unique_lines;
+    to->first_touches += from->first_touches;
+    to->dist_count += from->dist_count;
+    to->time_count += from->time_count;
+    reuse_result_set128(to->dist_sum, reuse_result_get128(to->dist_sum) +
+                            reuse_result_get128(from->dist_sum));
+    reuse_result_set128(to->dist_sqsum, reuse_result_get128(to->dist_sqsum) +
+                            reuse_result_get128(from->dist_sqsum));
+    reuse_result_set128(to->time_sum, reuse_result_get128(to->time_sum) +
+                            reuse_result_get128(from->time_sum));
+    reuse_result_set128(to->time_sqsum, reuse_result_get128(to->time_sqsum) +
+                            reuse_result_get128(from->time_sqsum));
+    const uint64_t *from_dist = reuse_result_dist_hist(from);
+    uint64_t *to_dist = reuse_result_dist_hist(to);
+    // The two histograms are contiguous.
+    for (size_t i = 0; i < 2 * header->hist_buckets; ++i)
+        to_dist[i] += from_dist[i];
+}
+
+/* The merge of every input aggregate of one granularity. */
+struct merged_grain_t {
+    std::vector<uint64_t> total;
+    // The inputs' aggregates, renumbered by input.
+    std::vector<uint64_t> inputs;
+    uint32_t input_records = 0;
+    // Each input's top lines are summed by address, then ranked again.
+    std::unordered_map<uint64_t, std::pair<uint64_t, uint64_t>> lines;
+};
+
+static void
+add_top_lines(const reuse_result_header_t *header, const reuse_result_record_t *record,
+              merged_grain_t *grain)
+{
+    const reuse_result_line_t *by_refs = reuse_result_top(record, header, 0);
+    const reuse_result_line_t *by_refs_end = by_refs + header->top_lines;
+    for (int table = 0; table < 2; ++table) {
+        const reuse_result_line_t *top = reuse_result_top(record, header, table);
+        for (uint32_t l = 0; l < header->top_lines && top[l].addr != 0; ++l) {
+            // A line in both tables is counted once.
+            uint64_t addr = top[l].addr;
+            if (table == 1 &&
+                std::find_if(by_refs, by_refs_end, [addr](const reuse_result_line_t &r) {
+                    return r.addr == addr;
+                }) != by_refs_end)
+                continue;
+            std::pair<uint64_t, uint64_t> &line = grain->lines[addr];
+            line.first += top[l].total_refs;
+            line.second += top[l].distant_refs;
+        }
+    }
+}
+
+static void
+rank_top_lines(const reuse_result_header_t *header, const merged_grain_t &grain,
+               reuse_result_record_t *record)
+{
+    std::vector<reuse_result_line_t> ranked;
+    ranked.reserve(grain.lines.size());
+    for (const auto &line : grain.lines) {
+        reuse_result_line_t entry = { line.first, line.second.first, line.second.second };
+        ranked.push_back(entry);
+    }
+    for (int table = 0; table < 2; ++table) {
+        size_t count = std::min<size_t>(ranked.size(), header->top_lines);
+        // Ties fall back to the address so the output does not depend on
+        // the hash order.
+        std::partial_sort(ranked.begin(), ranked.begin() + count, ranked.end(),
+                          [table](const reuse_result_line_t &l, const reuse_result_line_t &r) {
+                              uint64_t lkey = table == 0 ? l.total_refs : l.distant_refs;
+                              uint64_t rkey = table == 0 ? r.total_refs : r.distant_refs;
+                              if (lkey != rkey)
+                                  return lkey > rkey;
+                              return l.addr < r.addr;
+                          });
+        std::copy(ranked.begin(), ranked.begin() + count,
+                  reuse_result_top(record, header, table));
+    }
+}
+
+static int
+merge(int argc, char **argv)
+{
+    if (argc < 3 || strcmp(argv[0], "-o") != 0) {
+        usage();
+        return 1;
+    }
+    const char *out_path = argv[1];
+    argc -= 2;
+    argv += 2;
+    reuse_result_header_t header;
+    const char *header_path = NULL;
+    // In the order each granularity is first seen.
+    std::vector<merged_grain_t> grains;
+    size_t record_words = 0;
+    for (int i = 0; i < argc; ++i) {
+        mapped_result_t result;
+        std::string error;
+        if (!result.open(argv[i], &error)) {
+            fprintf(stderr, "%s: %s\n", argv[i], error.c_str());
+            return 1;
+        }
+        const reuse_result_header_t *in_header = result.header();
+        if (header_path == NULL) {
+            reuse_result_header_init(&header, in_header->hist_bits, in_header->hist_buckets,
+                                     in_header->top_lines, in_header->line_size,
+                                     in_header->distance_threshold, 0);
+            header_path = argv[i];
+            record_words = header.record_size / sizeof(uint64_t);
+        } else if (in_header->hist_bits != header.hist_bits ||
+                   in_header->top_lines != header.top_lines) {
+            fprintf(stderr, "%s: histogram or top-line sizes differ from %s\n", argv[i],
+                    header_path);
+            return 1;
+        } else if (in_header->line_size != header.line_size ||
+                   in_header->distance_threshold != header.distance_threshold) {
+            // Distances and distant references mean different things then.
+            fprintf(stderr, "%s: line size or distance threshold differs from %s\n",
+                    argv[i], header_path);
+            return 1;
+        }
+        for (uint32_t r = 0; r < in_header->records; ++r) {
+            const reuse_result_record_t *aggregate = reuse_result_record(in_header, r);
+            if (aggregate->shard >= 0)
+                continue;
+            merged_grain_t *grain = NULL;
+            for (merged_grain_t &existing : grains) {
+                const reuse_result_record_t *total =
+                    reinterpret_cast<const reuse_result_record_t *>(existing.total.data());
+                if (total->line_bits == aggregate->line_bits)
+                    grain = &existing;
+            }
+            reuse_result_record_t *total;
+            if (grain == NULL) {
+                grains.emplace_back();
+                grain = &grains.back();
+                grain->total.resize(record_words, 0);
+                total = reinterpret_cast<reuse_result_record_t *>(grain->total.data());
+                total->shard = -1;
+                total->line_bits = aggregate->line_bits;
+                total->sample_weight = aggregate->sample_weight;
+            } else
+                total = reinterpret_cast<reuse_result_record_t *>(grain->total.data());
+            add_record(&header, aggregate, total);
+            // Mixed sampling rates leave no single weight to report.
+            if (aggregate->sample_weight != total->sample_weight)
+                total->sample_weight = 0;
+            add_top_lines(in_header, aggregate, grain);
+            size_t offset = grain->inputs.size();
+            grain->inputs.resize(offset + record_words);
+            memcpy(&grain->inputs[offset], aggregate, header.record_size);
+            reinterpret_cast<reuse_result_record_t *>(&grain->inputs[offset])->shard = i;
+            ++grain->input_records;
+        }
+    }
+    if (grains.empty()) {
+        fprintf(stderr, "no result records to merge\n");
+        return 1;
+    }
+    for (merged_grain_t &grain : grains) {
+        rank_top_lines(&header, grain,
+                       reinterpret_cast<reuse_result_record_t *>(grain.total.data()));
+        header.records += 1 + grain.input_records;
+    }
+    FILE *file = fopen(out_path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "%s: %s\n", out_path, strerror(errno));
+        return 1;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (const merged_grain_t &grain : grains) {
+        ok = ok && fwrite(grain.total.data(), header.record_size, 1, file) == 1 &&
+            fwrite(grain.inputs.data(), sizeof(uint64_t), grain.inputs.size(), file) ==
+                grain.inputs.size();
+    }
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "%s: write failed\n", out_path);
+        return 1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+    if (strcmp(argv[1], "query") == 0)
+        return query(argc - 2, argv + 2);
+    if (strcmp(argv[1], "merge") == 0)
+        return merge(argc - 2, argv + 2);
+    usage();
+    return 1;
+}
@@ -0,0 +1,214 @@
+/* reuse_result: the binary result file of the reuse distance tools.
+ *
+ * A file is one reuse_result_header_t followed by header.records records of
+ * header.record_size bytes each: for each tag granularity analyzed, the
+ * whole-trace aggregate and then one per shard.  A record is a
+ * reuse_result_record_t followed by the reuse distance histogram, the reuse
+ * time histogram (hist_buckets counts each, in log_histogram_t bucket order)
+ * and two tables of top_lines lines, by references and by distant references.
+ * Every field sits at a fixed offset in native (little-endian) byte order, so
+ * readers mmap the file and index it in place.
+ *
+ * The tools include this header from the DynamoRIO tree, so copy it into
+ * clients/drcachesim/tools/ next to reuse_distance.h.
+ */
+
+#ifndef _REUSE_RESULT_H_
+#define _REUSE_RESULT_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+static const char REUSE_RESULT_MAGIC[8] = { 'W', 'P', 'C', 'R', 'E', 'U', 'S', 'E' };
+// Bump whenever the layout below changes.
+static const uint32_t REUSE_RESULT_VERSION = 1;
+
+struct reuse_result_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size; // bytes, trailing arrays included
+    uint32_t records;
+    uint32_t hist_bits; // the histograms' sub-buckets per octave, log2
+    uint32_t hist_buckets;
+    uint32_t top_lines; // entries in each top-line table
+    uint32_t line_size;
+    uint64_t distance_threshold;
+    uint64_t reserved[2];
+};
+
+struct reuse_result_line_t {
+    uint64_t addr; // 0 marks an unused entry
+    uint64_t total_refs;
+    uint64_t distant_refs;
+};
+
+struct reuse_result_record_t {
+    int64_t shard; // -1 for the aggregate
+    int64_t tid;
+    uint64_t total_refs;
+    uint64_t unique_accesses;
+    uint64_t unique_lines;
+    uint64_t first_touches;
+    uint64_t sample_weight;
+    uint64_t dist_count;
+    uint64_t time_count;
+    uint64_t line_bits; // tags are addresses shifted right by this
+    // 128-bit sums, low word first.
+    uint64_t dist_sum[2];
+    uint64_t dist_sqsum[2];
+    uint64_t time_sum[2];
+    uint64_t time_sqsum[2];
+};
+
+static_assert(sizeof(reuse_result_header_t) == 64, "reuse_result_header_t layout");
+static_assert(sizeof(reuse_result_record_t) == 144, "reuse_result_record_t layout");
+
+static inline size_t
+reuse_result_record_size(uint32_t hist_buckets, uint32_t top_lines)
+{
+    return sizeof(reuse_result_record_t) + 2 * hist_buckets * sizeof(uint64_t) +
+        2 * top_lines * sizeof(reuse_result_line_t);
+}
+
+static inline void
+reuse_result_header_init(reuse_result_header_t *header, uint32_t hist_bits,
+                         uint32_t hist_buckets, uint32_t top_lines, uint32_t line_size,
+                         uint64_t distance_threshold, uint32_t records)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, REUSE_RESULT_MAGIC, sizeof(header->magic));
+    header->version = REUSE_RESULT_VERSION;
+    header->header_size = sizeof(*header);
+    header->record_size =
+        static_cast<uint32_t>(reuse_result_record_size(hist_buckets, top_lines));
+    header->records = records;
+    header->hist_bits = hist_bits;
+    header->hist_buckets = hist_buckets;
+    header->top_lines = top_lines;
+    header->line_size = line_size;
+    header->distance_threshold = distance_threshold;
+}
+
+// Returns the header if data holds a whole result file this code can read,
+// or NULL with the reason in *error.
+static inline const reuse_result_header_t *
+reuse_result_check(const void *data, size_t size, std::string *error)
+{
+    const reuse_result_header_t *header =
+        reinterpret_cast<const reuse_result_header_t *>(data);
+    if (size < sizeof(*header) ||
+        memcmp(header->magic, REUSE_RESULT_MAGIC, sizeof(header->magic)) != 0) {
+        *error = "not a reuse distance result file";
+        return NULL;
+    }
+    if (header->version != REUSE_RESULT_VERSION) {
+        *error = "unsupported result file version " + std::to_string(header->version);
+        return NULL;
+    }
+    if (header->header_size < sizeof(*header) ||
+        header->record_size !=
+            reuse_result_record_size(header->hist_buckets, header->top_lines) ||
+        header->hist_buckets != (65 - header->hist_bits) << header->hist_bits ||
+        header->header_size + static_cast<uint64_t>(header->records) * header->record_size >
+            size) {
+        *error = "truncated or inconsistent result file";
+        return NULL;
+    }
+    return header;
+}
+
+static inline const reuse_result_record_t *
+reuse_result_record(const reuse_result_header_t *header, uint32_t index)
+{
+    return reinterpret_cast<const reuse_result_record_t *>(
+        reinterpret_cast<const char *>(header) + header->header_size +
+        static_cast<size_t>(index) * header->record_size);
+}
+
+static inline uint64_t *
+reuse_result_dist_hist(reuse_result_record_t *record)
+{
+    return reinterpret_cast<uint64_t *>(record + 1);
+}
+
+static inline const uint64_t *
+reuse_result_dist_hist(const reuse_result_record_t *record)
+{
+    return reinterpret_cast<const uint64_t *>(record + 1);
+}
+
+static inline uint64_t *
+reuse_result_time_hist(reuse_result_record_t *record, const reuse_result_header_t *header)
+{
+    return reuse_result_dist_hist(record) + header->hist_buckets;
+}
+
+static inline const uint64_t *
+reuse_result_time_hist(const reuse_result_record_t *record,
+                       const reuse_result_header_t *header)
+{
+    return reuse_result_dist_hist(record) + header->hist_buckets;
+}
+
+// Table 0 is ranked by references, table 1 by distant references.
+static inline reuse_result_line_t *
+reuse_result_top(reuse_result_record_t *record, const reuse_result_header_t *header,
+                 int table)
+{
+    return reinterpret_cast<reuse_result_line_t *>(reuse_result_time_hist(record, header) +
+                                                   header->hist_buckets) +
+        table * header->top_lines;
+}
+
+static inline const reuse_result_line_t *
+reuse_result_top(const reuse_result_record_t *record, const reuse_result_header_t *header,
+                 int table)
+{
+    return reinterpret_cast<const reuse_result_line_t *>(
+               reuse_result_time_hist(record, header) + header->hist_buckets) +
+        table * header->top_lines;
+}
+
+static inline __uint128_t
+reuse_result_get128(const uint64_t words[2])
+{
+    return (static_cast<__uint128_t>(words[1]) << 64) | words[0];
+}
+
+static inline void
+reuse_result_set128(uint64_t words[2], __uint128_t value)
+{
+    words[0] = static_cast<uint64_t>(value);
+    words[1] = static_cast<uint64_t>(value >> 64);
+}
+
+// The smallest value log_histogram_t records into bucket index.
+static inline uint64_t
+reuse_result_bucket_low(uint32_t hist_bits, size_t index)
+{
+    if (index < (static_cast<size_t>(2) << hist_bits))
+        return index;
+    int shift = static_cast<int>(index >> hist_bits) - 1;
+    return static_cast<uint64_t>(index - (static_cast<size_t>(shift) << hist_bits))
+        << shift;
+}
+
+// As log_histogram_t::percentile.
+static inline uint64_t
+reuse_result_percentile(const reuse_result_header_t *header, const uint64_t *hist,
+                        uint64_t count, double fraction)
+{
+    uint64_t target = static_cast<uint64_t>(fraction * count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < header->hist_buckets; ++i) {
+        seen += hist[i];
+        if (hist[i] > 0 && seen >= target)
+            return reuse_result_bucket_low(header->hist_bits, i);
+    }
+    return 0;
+}
+
+#endif /* _REUSE_RESULT_H_ */
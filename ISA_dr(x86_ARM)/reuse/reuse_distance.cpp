@@ -0,0 +1,2323 @@
+/* **********************************************************
+ * Copyright (c) 2016-2020 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Google, Inc. nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL VMWARE, INC. OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+#include <iostream>
+#include <stdio.h>
+#include <cmath>
+#include <cstring>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cassert>
+#include <iostream>
+#include <functional>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+#include "reuse_distance.h"
+#include "../common/utils.h"
+
+//const std::string ::reuse_distance_t::TOOL_NAME = "Reuse distance tool";
+
+unsigned int ::reuse_distance_t::knob_verbose;
+
+// drcachesim's option table lives in the DynamoRIO tree, so the knobs this
+// tool adds on top of reuse_distance_knobs_t are read from the environment.
+static std::string
+env_knob(const char *name, const char *default_value)
+{
+    const char *value = getenv(name);
+    return value == NULL ? default_value : value;
+}
+
+// The splitmix64 finalizer: cheap, and every tag bit reaches the sampled bits.
+static inline uint64_t
+hash_tag(addr_t tag)
+{
+    uint64_t hash = tag;
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    hash = hash ^ (hash >> 31);
+    return hash & (SAMPLE_MODULUS - 1);
+}
+
+static reuse_engine_t
+parse_engine(const std::string &name)
+{
+    if (name == "list")
+        return ENGINE_LIST;
+    if (name == "hotl")
+        return ENGINE_NONE;
+    return ENGINE_TREE;
+}
+
+// A comma-separated list of address shifts, e.g. "3,6,12,21" for words,
+// cache lines, 4K pages and 2M pages.
+static std::vector<int>
+parse_shifts(const std::string &list)
+{
+    std::vector<int> shifts;
+    const char *pos = list.c_str();
+    while (*pos != '\0') {
+        char *end;
+        long shift = strtol(pos, &end, 10);
+        if (end == pos)
+            break;
+        if (shift >= 0 && shift < 64 &&
+            std::find(shifts.begin(), shifts.end(), shift) == shifts.end())
+            shifts.push_back(static_cast<int>(shift));
+        pos = *end == ',' ? end + 1 : end;
+    }
+    if (shifts.empty())
+        shifts.push_back(0);
+    return shifts;
+}
+
+// A byte count with an optional K, M or G suffix, 0 if malformed.
+static uint64_t
+parse_size(const std::string &text)
+{
+    char *end;
+    uint64_t size = strtoull(text.c_str(), &end, 10);
+    const char *units = "KMG";
+    const char *unit = *end == '\0' ? NULL : strchr(units, *end);
+    if (unit != NULL) {
+        size <<= 10 * (unit - units + 1);
+        ++end;
+    }
+    return *end == '\0' ? size : 0;
+}
+
+static std::string
+trim(const std::string &text)
+{
+    size_t begin = text.find_first_not_of(" \t\r");
+    size_t end = text.find_last_not_of(" \t\r");
+    return begin == std::string::npos ? "" : text.substr(begin, end - begin + 1);
+}
+
+// Reads the module list drcachesim keeps next to a raw trace (modules.log):
+// a "Columns:" line names the fields, then each module segment takes one
+// comma-separated line with the path, which may hold commas itself, last.
+static bool
+load_module_list(const std::string &path, std::vector<module_range_t> *modules)
+{
+    std::ifstream file(path);
+    if (!file)
+        return false;
+    std::vector<std::string> columns;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.compare(0, 8, "Columns:") == 0) {
+            std::istringstream names(line.substr(8));
+            std::string name;
+            while (std::getline(names, name, ','))
+                columns.push_back(trim(name));
+            continue;
+        }
+        if (columns.empty())
+            continue;
+        std::vector<std::string> fields;
+        size_t pos = 0;
+        for (size_t i = 0; i + 1 < columns.size(); ++i) {
+            size_t comma = line.find(',', pos);
+            if (comma == std::string::npos)
+                break;
+            fields.push_back(trim(line.substr(pos, comma - pos)));
+            pos = comma + 1;
+        }
+        if (fields.size() + 1 != columns.size())
+            continue;
+        fields.push_back(trim(line.substr(pos)));
+        module_range_t range = { 0, 0, 0, "" };
+        for (size_t i = 0; i < columns.size(); ++i) {
+            // Older versions call the start "base".
+            if (columns[i] == "start" || columns[i] == "base")
+                range.start = strtoull(fields[i].c_str(), NULL, 16);
+            else if (columns[i] == "end")
+                range.end = strtoull(fields[i].c_str(), NULL, 16);
+            else if (columns[i] == "offset")
+                range.offset = strtoull(fields[i].c_str(), NULL, 16);
+            else if (columns[i] == "path")
+                range.path = fields[i];
+        }
+        if (range.end > range.start)
+            modules->push_back(range);
+    }
+    std::sort(modules->begin(), modules->end(),
+              [](const module_range_t &l, const module_range_t &r) {
+                  return l.start < r.start;
+              });
+    return !columns.empty();
+}
+
+analysis_tool_t *
+reuse_distance_tool_create(const reuse_distance_knobs_t &knobs)
+{
+    // "data" (default), "instr" or "combined".
+    std::string stream = env_knob("WPC_REUSE_STREAM", "data");
+    if (stream == "instr")
+        return new reuse_stream_tool_t<instr_stream_t>(knobs);
+    if (stream == "combined")
+        return new reuse_stream_tool_t<combined_stream_t>(knobs);
+    if (stream != "data")
+        std::cerr << "Unknown WPC_REUSE_STREAM " << stream << ": using data\n";
+    return new reuse_stream_tool_t<data_stream_t>(knobs);
+}
+
+reuse_distance_t::reuse_distance_t(const reuse_distance_knobs_t &knobs,
+                                   const reuse_stream_traits_t &stream)
+    : knobs_(knobs)
+    , line_size_bits_(compute_log2((int)knobs_.line_size))
+    , stream_(stream)
+    // "tree" (default) or "list": both give the same histogram.
+    , engine_(parse_engine(env_knob("WPC_REUSE_ENGINE", "tree")))
+    , footprint_(env_knob("WPC_FOOTPRINT", engine_ == ENGINE_NONE ? "1" : "0") != "0")
+    , sample_threshold_(SAMPLE_MODULUS)
+    // A fixed number of sampled lines, with the rate lowered as needed.
+    , sample_max_(strtoull(env_knob("WPC_SHARDS_MAX", "0").c_str(), NULL, 0))
+    // 32 buckets per octave keep every bucket within ~3% of its values.
+    , mrc_assoc_(atoi(env_knob("WPC_MRC_ASSOC", "0").c_str()))
+    , hist_bits_(atoi(env_knob("WPC_HIST_SUB_BITS", "5").c_str()))
+    , line_shifts_(parse_shifts(env_knob("WPC_LINE_SHIFTS", "0")))
+    , interval_refs_(strtoull(env_knob("WPC_INTERVAL_REFS", "0").c_str(), NULL, 0))
+    , interval_usec_(strtoull(env_knob("WPC_INTERVAL_USEC", "0").c_str(), NULL, 0))
+    , interval_file_(NULL)
+    , stats_usec_(strtoull(env_knob("WPC_STATS_MSEC", "0").c_str(), NULL, 0) * 1000)
+    , stats_file_(NULL)
+    , start_time_(std::chrono::steady_clock::now())
+    , result_path_(env_knob("WPC_RESULT_FILE", ""))
+    , pc_entries_(strtoull(env_knob("WPC_PC_ENTRIES", "1024").c_str(), NULL, 0))
+    , set_sets_(0)
+    , set_ways_(0)
+    , checkpoint_records_(
+          strtoull(env_knob("WPC_CHECKPOINT_REFS", "0").c_str(), NULL, 0))
+    , checkpoint_path_(env_knob("WPC_CHECKPOINT_FILE", "reuse_checkpoint"))
+    , resume_(env_knob("WPC_RESUME", "0") != "0")
+    , shared_(env_knob("WPC_SHARED", "0") != "0")
+    , sharing_(env_knob("WPC_SHARING", "0") != "0")
+    , log_path_(env_knob("WPC_LOG_FILE", "reuse_log"))
+{
+    // A fixed sampling rate in (0, 1), or the starting rate with WPC_SHARDS_MAX.
+    double rate = atof(env_knob("WPC_SHARDS_RATE", "1").c_str());
+    if (rate > 0 && rate < 1) {
+        sample_threshold_ =
+            std::max<uint64_t>(1, static_cast<uint64_t>(rate * SAMPLE_MODULUS));
+    }
+    sampling_ = sample_threshold_ < SAMPLE_MODULUS || sample_max_ > 0;
+    if (engine_ == ENGINE_NONE) {
+        // There are no distances to attribute to pcs or to replay.
+        pc_entries_ = 0;
+        if (shared_) {
+            std::cerr << "WPC_SHARED needs a stack distance engine: ignored with "
+                      << "WPC_REUSE_ENGINE=hotl\n";
+            shared_ = false;
+        }
+    }
+    // A fetch's pc is its own address, so the per-pc tables would repeat the
+    // line tables.
+    if (!stream_.data)
+        pc_entries_ = 0;
+    if (sharing_ && !stream_.data) {
+        std::cerr << "WPC_SHARING needs data accesses: ignored with WPC_REUSE_STREAM="
+                  << stream_.name << "\n";
+        sharing_ = false;
+    }
+    // The miss ratio curve needs tags of at least a line, so asking for its
+    // extra columns adds the -line_size granularity when none is that coarse.
+    if (((mrc_assoc_ > 0 && engine_ != ENGINE_NONE) || footprint_) &&
+        *std::max_element(line_shifts_.begin(), line_shifts_.end()) <
+            static_cast<int>(line_size_bits_))
+        line_shifts_.push_back(static_cast<int>(line_size_bits_));
+    std::string set_cache = env_knob("WPC_SET_CACHE", "");
+    if (!set_cache.empty()) {
+        size_t colon = set_cache.find(':');
+        uint64_t size = parse_size(set_cache.substr(0, colon));
+        set_ways_ = colon == std::string::npos ? 0 : atoi(set_cache.c_str() + colon + 1);
+        if (set_ways_ > 0)
+            set_sets_ = size / knobs_.line_size / set_ways_;
+        if (set_sets_ == 0) {
+            std::cerr << "Bad WPC_SET_CACHE " << set_cache
+                      << " (want <size>:<ways>, e.g. 32K:8): set model disabled\n";
+        }
+    }
+    std::string module_file = env_knob("WPC_MODULE_FILE", "");
+    if (!module_file.empty() && !load_module_list(module_file, &modules_))
+        std::cerr << "Failed to read " << module_file << ": pcs left unsymbolized\n";
+    if (interval_refs_ > 0 || interval_usec_ > 0) {
+        std::string path = env_knob("WPC_INTERVAL_FILE", "reuse_intervals.txt");
+        // A resumed run adds to the records so far; those a shard wrote after
+        // its last checkpoint come again.
+        interval_file_ = fopen(path.c_str(), resume_ ? "a" : "w");
+        if (interval_file_ == NULL) {
+            std::cerr << "Failed to open " << path << ": interval records disabled\n";
+            interval_refs_ = 0;
+            interval_usec_ = 0;
+        } else if (!resume_) {
+            fprintf(interval_file_,
+                    "# shard line_bits interval refs end_ref end_usec cold reuses dist_mean "
+                    "dist_p50 dist_p90 dist_p99 time_mean dist_octaves...\n");
+        }
+    }
+    if (stats_usec_ > 0) {
+        std::string path = env_knob("WPC_STATS_FILE", "");
+        stats_file_ = path.empty() ? stderr : fopen(path.c_str(), "w");
+        if (stats_file_ == NULL) {
+            std::cerr << "Failed to open " << path << ": telemetry disabled\n";
+            stats_usec_ = 0;
+        }
+    }
+    if (DEBUG_VERBOSE(2)) {
+        std::cerr << "cache line size " << knobs_.line_size << ", "
+                  << "reuse distance threshold " << knobs_.distance_threshold
+                  << ", engine "
+                  << (engine_ == ENGINE_TREE ? "tree"
+                                             : engine_ == ENGINE_LIST ? "list" : "hotl")
+                  << std::endl;
+    }
+    if (checkpoint_records_ > 0)
+        checkpoint_thread_ = std::thread(&reuse_distance_t::write_checkpoints, this);
+}
+
+reuse_distance_t::~reuse_distance_t()
+{
+    if (checkpoint_thread_.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(checkpoint_mutex_);
+            checkpoint_stop_ = true;
+        }
+        checkpoint_cond_.notify_all();
+        checkpoint_thread_.join();
+    }
+    for (auto &shard : shard_map_) {
+        delete shard.second;
+    }
+    if (interval_file_ != NULL)
+        fclose(interval_file_);
+    if (stats_file_ != NULL && stats_file_ != stderr)
+        fclose(stats_file_);
+}
+
+reuse_distance_t::shard_data_t::shard_data_t(uint64_t reuse_threshold, uint64_t skip_dist,
+                                             bool verify, reuse_engine_t engine,
+                                             int hist_bits, size_t top_lines)
+    : line_pool(engine == ENGINE_LIST)
+    , top { line_top_t(0, top_lines), line_top_t(1, top_lines) }
+    , dist_hist(hist_bits)
+    , kind_hist(REUSE_KINDS, log_histogram_t(hist_bits))
+    , time_hist(hist_bits)
+    , first_hist(hist_bits)
+    , reuse_threshold(reuse_threshold)
+{
+    if (engine == ENGINE_TREE) {
+        ref_tree = std::unique_ptr<line_ref_tree_t>(new line_ref_tree_t(reuse_threshold));
+    } else if (engine == ENGINE_LIST) {
+        ref_list = std::unique_ptr<line_ref_list_t>(
+            new line_ref_list_t(reuse_threshold, skip_dist, verify));
+    }
+}
+
+uint64_t &
+reuse_distance_t::shard_data_t::cur_time()
+{
+    return ref_tree ? ref_tree->cur_time_ : ref_list ? ref_list->cur_time_ : untracked_time;
+}
+
+uint64_t
+reuse_distance_t::shard_data_t::cur_time() const
+{
+    return ref_tree ? ref_tree->cur_time_ : ref_list ? ref_list->cur_time_ : untracked_time;
+}
+
+void
+reuse_distance_t::shard_data_t::set_sample_threshold(uint64_t threshold)
+{
+    sample_threshold = threshold;
+    sample_weight = std::max<int_least64_t>(
+        1, llround(static_cast<double>(SAMPLE_MODULUS) / std::max<uint64_t>(threshold, 1)));
+    // The engines see unscaled distances, so scale the threshold down to match.
+    uint64_t engine_threshold = (reuse_threshold + sample_weight - 1) / sample_weight;
+    if (ref_tree)
+        ref_tree->threshold_ = engine_threshold;
+    else if (ref_list)
+        ref_list->threshold_ = engine_threshold;
+}
+
+void
+reuse_distance_t::shard_data_t::shrink_sample(size_t max_lines)
+{
+    while (cache_map.size() > max_lines && !sample_heap.empty()) {
+        set_sample_threshold(sample_heap.top().first);
+        while (!sample_heap.empty() && sample_heap.top().first >= sample_threshold) {
+            addr_t tag = sample_heap.top().second;
+            sample_heap.pop();
+            line_ref_t *ref = cache_map.find(tag);
+            top[0].remove(ref);
+            top[1].remove(ref);
+            if (ref_tree)
+                ref_tree->remove(ref);
+            else if (ref_list)
+                ref_list->remove(ref);
+            cache_map.erase(tag);
+            line_pool.free(ref);
+        }
+    }
+}
+
+reuse_distance_t::shard_data_t *
+reuse_distance_t::create_shard()
+{
+    shard_data_t *shard = NULL;
+    for (int shift : line_shifts_) {
+        auto grain = new shard_data_t(knobs_.distance_threshold, knobs_.skip_list_distance,
+                                      knobs_.verify_skip, engine_, hist_bits_,
+                                      knobs_.report_top * TOP_LINES_TRACKED);
+        grain->set_sample_threshold(sample_threshold_);
+        grain->line_bits = shift;
+        if (pc_entries_ > 0)
+            grain->pcs.reset(new pc_summary_t(pc_entries_));
+        if (shard == NULL) {
+            shard = grain;
+            if (set_sets_ > 0)
+                shard->set_model.reset(new set_model_t(set_sets_, set_ways_));
+        } else
+            shard->extra_grains.emplace_back(grain);
+    }
+    return shard;
+}
+
+reuse_distance_t::shard_data_t *
+reuse_distance_t::create_indexed_shard(int_least64_t index)
+{
+    // The logs' files are named for the shard, and a resumed one keeps them.
+    auto create = [this, index](bool resuming) -> shard_data_t * {
+        shard_data_t *shard = create_shard();
+        shard->index = index;
+        std::string path = log_path_ + "." + std::to_string(index);
+        if (shared_)
+            shard->shared_log.reset(new shared_log_t(path + ".shared", false, resuming));
+        if (sharing_)
+            shard->sharing_log.reset(new shared_log_t(path + ".sharing", true, resuming));
+        shard->start_chunk(0);
+        return shard;
+    };
+    shard_data_t *shard = create(resume_);
+    if (resume_ && !load_checkpoint(shard)) {
+        // Whatever part of it was restored goes.
+        delete shard;
+        shard = create(false);
+    }
+    shard->stats_usec = elapsed_usec();
+    shard->stats_records = shard->records;
+    return shard;
+}
+
+// A checkpoint file is a whole segment followed by any number of segments
+// holding the changes since the one before.  A segment is this header, the
+// payload, and the trailer, so a segment cut short by a crash is ignored.
+static const char CHECKPOINT_MAGIC[8] = { 'W', 'P', 'C', 'C', 'K', 'P', 'T', '4' };
+static const char CHECKPOINT_END[8] = { 'W', 'P', 'C', 'C', 'K', 'E', 'N', 'D' };
+
+struct checkpoint_header_t {
+    char magic[8];
+    uint64_t whole;   // 1 for a whole segment
+    uint64_t records; // the shard's records the state covers
+    uint64_t bytes;   // the payload's
+};
+
+struct checkpoint_trailer_t {
+    uint64_t bytes;
+    char magic[8];
+};
+
+// A line's record; the access_kind_t is in the top two bits of last.
+struct checkpoint_line_t {
+    addr_t tag;
+    uint64_t total_refs;
+    uint64_t distant_refs;
+    uint64_t last;
+};
+
+void
+reuse_distance_t::save_checkpoint(shard_data_t *shard)
+{
+    bool failed;
+    {
+        // The previous segment has had checkpoint_records_ records to go out.
+        std::unique_lock<std::mutex> lock(checkpoint_mutex_);
+        checkpoint_cond_.wait(lock, [shard] { return !shard->checkpoint_pending; });
+        failed = shard->checkpoint_failed;
+        shard->checkpoint_failed = false;
+    }
+    // A lost segment leaves later ones nothing to apply to.
+    bool whole = failed || shard->checkpoint_full_bytes == 0 ||
+        shard->checkpoint_bytes > 2 * shard->checkpoint_full_bytes;
+    snapshot_buffer_t out;
+    checkpoint_header_t header;
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.whole = whole;
+    header.records = shard->records;
+    header.bytes = 0;
+    out.put(header);
+    // The settings that shape the state, to refuse a mismatched resume.
+    out.put<uint64_t>(static_cast<uint64_t>(stream_.data | stream_.instr << 1));
+    out.put<uint64_t>(shard->grains());
+    out.put<uint64_t>(engine_);
+    out.put<uint64_t>(knobs_.line_size);
+    out.put<uint64_t>(knobs_.distance_threshold);
+    out.put<uint64_t>(sample_threshold_);
+    out.put<uint64_t>(sample_max_);
+    out.put<uint64_t>(hist_bits_);
+    out.put<uint64_t>(pc_entries_);
+    out.put<uint64_t>(set_sets_);
+    out.put<uint64_t>(set_ways_);
+    out.put<uint64_t>(shared_);
+    out.put<uint64_t>(sharing_);
+
+    out.put(shard->tid);
+    out.put(shard->interval_count);
+    out.put(shard->interval_start_usec);
+    out.put(shard->last_usec);
+    std::vector<checkpoint_line_t> lines;
+    for (size_t i = 0; i < shard->grains(); ++i) {
+        shard_data_t *grain = shard->grain(i);
+        out.put(grain->line_bits);
+        out.put(grain->total_refs);
+        out.put(grain->cur_ref);
+        out.put(grain->first_touches);
+        out.put(grain->sampled_refs);
+        out.put(grain->sampled_reuses);
+        out.put(grain->sample_threshold);
+        out.put(grain->cur_time());
+        out.put(grain->interval_start_ref);
+        out.put(grain->interval_first_touches);
+        grain->dist_hist.save(&out);
+        for (const log_histogram_t &hist : grain->kind_hist)
+            hist.save(&out);
+        grain->time_hist.save(&out);
+        grain->first_hist.save(&out);
+        out.put<uint64_t>(grain->interval_dist_base != nullptr);
+        if (grain->interval_dist_base) {
+            grain->interval_dist_base->save(&out);
+            grain->interval_time_base->save(&out);
+        }
+        if (grain->pcs)
+            grain->pcs->save(&out);
+        // Only the lines touched since the last checkpoint, unless whole.
+        lines.clear();
+        if (whole) {
+            for (const auto &entry : grain->cache_map) {
+                line_ref_t *ref = entry.second;
+                ref->dirty = 0;
+                lines.push_back({ ref->tag, ref->total_refs, ref->distant_refs,
+                                  ref->last_ref | static_cast<uint64_t>(ref->last_kind) << 62 });
+            }
+        } else {
+            for (addr_t tag : grain->dirty_tags) {
+                line_ref_t *ref = grain->cache_map.find(tag);
+                if (ref == NULL || !ref->dirty)
+                    continue;
+                ref->dirty = 0;
+                lines.push_back({ ref->tag, ref->total_refs, ref->distant_refs,
+                                  ref->last_ref | static_cast<uint64_t>(ref->last_kind) << 62 });
+            }
+        }
+        grain->dirty_tags.clear();
+        out.put_vector(lines);
+    }
+    if (shard->set_model)
+        shard->set_model->save(&out);
+    shared_log_t *logs[2] = { shard->shared_log.get(), shard->sharing_log.get() };
+    for (int i = 0; i < 2; ++i) {
+        if (logs[i] == NULL)
+            continue;
+        // The log's file takes what is buffered, so its length and the open
+        // chunk's key are all the log's state.
+        logs[i]->spill();
+        out.put<uint64_t>(logs[i]->chunks.back().key);
+        out.put<uint64_t>(logs[i]->length);
+    }
+    header.bytes = out.data.size() - sizeof(header);
+    memcpy(out.data.data(), &header, sizeof(header));
+    checkpoint_trailer_t trailer;
+    trailer.bytes = header.bytes;
+    memcpy(trailer.magic, CHECKPOINT_END, sizeof(trailer.magic));
+    out.put(trailer);
+
+    if (whole) {
+        shard->checkpoint_bytes = 0;
+        shard->checkpoint_full_bytes = out.data.size();
+    }
+    shard->checkpoint_bytes += out.data.size();
+    {
+        std::lock_guard<std::mutex> guard(checkpoint_mutex_);
+        checkpoint_jobs_.push_back(checkpoint_job_t());
+        checkpoint_job_t &job = checkpoint_jobs_.back();
+        job.shard = shard;
+        job.whole = whole;
+        job.records = shard->records;
+        job.path = checkpoint_path_ + "." + std::to_string(shard->index);
+        job.data.swap(out.data);
+        shard->checkpoint_pending = true;
+    }
+    checkpoint_cond_.notify_all();
+}
+
+void
+reuse_distance_t::write_checkpoints()
+{
+    std::unique_lock<std::mutex> lock(checkpoint_mutex_);
+    while (true) {
+        checkpoint_cond_.wait(lock,
+                              [this] { return checkpoint_stop_ || !checkpoint_jobs_.empty(); });
+        if (checkpoint_jobs_.empty())
+            return;
+        checkpoint_job_t job;
+        std::swap(job, checkpoint_jobs_.front());
+        checkpoint_jobs_.pop_front();
+        lock.unlock();
+        // The interval records so far must outlive a crash along with the state.
+        if (interval_file_ != NULL) {
+            std::lock_guard<std::mutex> guard(interval_mutex_);
+            fflush(interval_file_);
+        }
+        // A whole segment replaces the file only once it is safely written.
+        std::string target = job.whole ? job.path + ".tmp" : job.path;
+        FILE *file = fopen(target.c_str(), job.whole ? "wb" : "ab");
+        bool ok = file != NULL && fwrite(job.data.data(), job.data.size(), 1, file) == 1;
+        ok = file != NULL && fclose(file) == 0 && ok;
+        if (ok && job.whole)
+            ok = rename(target.c_str(), job.path.c_str()) == 0;
+        if (!ok) {
+            std::cerr << "Failed to write checkpoint " << job.path << " at record "
+                      << job.records << "\n";
+        }
+        lock.lock();
+        job.shard->checkpoint_failed = !ok;
+        job.shard->checkpoint_pending = false;
+        checkpoint_cond_.notify_all();
+    }
+}
+
+bool
+reuse_distance_t::load_checkpoint(shard_data_t *shard)
+{
+    std::string path = checkpoint_path_ + "." + std::to_string(shard->index);
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == NULL)
+        return false;
+    // The lines by tag across the segments, the latest record winning.
+    std::vector<std::unordered_map<addr_t, checkpoint_line_t>> lines(shard->grains());
+    // The engines' clocks, set once the lines are back.
+    std::vector<uint64_t> cur_times(shard->grains());
+    // The logs' open chunk keys and file lengths.
+    uint64_t log_keys[2] = { 0, 0 };
+    uint64_t log_lengths[2] = { 0, 0 };
+    uint64_t records = 0;
+    bool ok = true;
+    checkpoint_header_t header;
+    while (ok && fread(&header, sizeof(header), 1, file) == 1) {
+        snapshot_buffer_t in;
+        in.data.resize(header.bytes + sizeof(checkpoint_trailer_t));
+        checkpoint_trailer_t trailer;
+        if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 ||
+            (records == 0 && header.whole == 0) ||
+            fread(in.data.data(), in.data.size(), 1, file) != 1)
+            break;
+        memcpy(&trailer, in.data.data() + header.bytes, sizeof(trailer));
+        if (trailer.bytes != header.bytes ||
+            memcmp(trailer.magic, CHECKPOINT_END, sizeof(trailer.magic)) != 0)
+            break;
+        in.data.resize(header.bytes);
+        ok = in.get<uint64_t>() == static_cast<uint64_t>(stream_.data | stream_.instr << 1) &&
+            in.get<uint64_t>() == shard->grains() && in.get<uint64_t>() == engine_ &&
+            in.get<uint64_t>() == knobs_.line_size &&
+            in.get<uint64_t>() == knobs_.distance_threshold &&
+            in.get<uint64_t>() == sample_threshold_ && in.get<uint64_t>() == sample_max_ &&
+            in.get<uint64_t>() == static_cast<uint64_t>(hist_bits_) &&
+            in.get<uint64_t>() == pc_entries_ && in.get<uint64_t>() == set_sets_ &&
+            in.get<uint64_t>() == static_cast<uint64_t>(set_ways_) &&
+            in.get<uint64_t>() == shared_ && in.get<uint64_t>() == sharing_;
+        if (!ok) {
+            std::cerr << "Checkpoint " << path << " was taken with other settings\n";
+            break;
+        }
+        shard->tid = in.get<memref_tid_t>();
+        shard->interval_count = in.get<uint64_t>();
+        shard->interval_start_usec = in.get<uint64_t>();
+        shard->last_usec = in.get<uint64_t>();
+        for (size_t i = 0; i < shard->grains() && in.ok; ++i) {
+            shard_data_t *grain = shard->grain(i);
+            if (in.get<int>() != grain->line_bits)
+                in.ok = false;
+            grain->total_refs = in.get<int_least64_t>();
+            grain->cur_ref = in.get<uint64_t>();
+            grain->first_touches = in.get<uint64_t>();
+            grain->sampled_refs = in.get<int_least64_t>();
+            grain->sampled_reuses = in.get<int_least64_t>();
+            grain->set_sample_threshold(in.get<uint64_t>());
+            cur_times[i] = in.get<uint64_t>();
+            grain->interval_start_ref = in.get<uint64_t>();
+            grain->interval_first_touches = in.get<uint64_t>();
+            grain->dist_hist.load(&in);
+            for (log_histogram_t &hist : grain->kind_hist)
+                hist.load(&in);
+            grain->time_hist.load(&in);
+            grain->first_hist.load(&in);
+            if (in.get<uint64_t>() != 0) {
+                grain->interval_dist_base.reset(new log_histogram_t(hist_bits_));
+                grain->interval_time_base.reset(new log_histogram_t(hist_bits_));
+                grain->interval_dist_base->load(&in);
+                grain->interval_time_base->load(&in);
+            }
+            if (grain->pcs)
+                grain->pcs->load(&in);
+            if (header.whole != 0)
+                lines[i].clear();
+            std::vector<checkpoint_line_t> changed;
+            in.get_vector(&changed);
+            for (const checkpoint_line_t &line : changed)
+                lines[i][line.tag] = line;
+        }
+        if (shard->set_model)
+            shard->set_model->load(&in);
+        if (shard->shared_log) {
+            log_keys[0] = in.get<uint64_t>();
+            log_lengths[0] = in.get<uint64_t>();
+        }
+        if (shard->sharing_log) {
+            log_keys[1] = in.get<uint64_t>();
+            log_lengths[1] = in.get<uint64_t>();
+        }
+        ok = in.ok && in.pos == in.data.size();
+        if (!ok)
+            std::cerr << "Checkpoint " << path << " is corrupt\n";
+        records = header.records;
+    }
+    fclose(file);
+    if (!ok || records == 0)
+        return false;
+    shared_log_t *logs[2] = { shard->shared_log.get(), shard->sharing_log.get() };
+    for (int i = 0; i < 2; ++i) {
+        if (logs[i] != NULL && !logs[i]->restore(log_keys[i], log_lengths[i])) {
+            std::cerr << "Log " << logs[i]->path << " is shorter than checkpoint " << path
+                      << "\n";
+            return false;
+        }
+    }
+
+    // Each granularity's lines go back in least recently used order, which
+    // rebuilds the engine's stack.
+    for (size_t i = 0; i < shard->grains(); ++i) {
+        shard_data_t *grain = shard->grain(i);
+        std::vector<const checkpoint_line_t *> order;
+        order.reserve(lines[i].size());
+        for (const auto &it : lines[i]) {
+            // Lines a shrinking sample dropped after they were saved.
+            if (!sampling_ || hash_tag(it.first) < grain->sample_threshold)
+                order.push_back(&it.second);
+        }
+        const uint64_t LAST_MASK = (static_cast<uint64_t>(1) << 62) - 1;
+        std::sort(order.begin(), order.end(),
+                  [LAST_MASK](const checkpoint_line_t *l, const checkpoint_line_t *r) {
+                      return (l->last & LAST_MASK) < (r->last & LAST_MASK);
+                  });
+        for (const checkpoint_line_t *line : order) {
+            line_ref_t *ref = grain->line_pool.alloc(line->tag);
+            grain->cache_map.insert(line->tag, ref);
+            if (grain->ref_tree)
+                grain->ref_tree->add_to_front(ref);
+            else if (grain->ref_list)
+                grain->ref_list->add_to_front(ref);
+            ref->total_refs = line->total_refs;
+            ref->distant_refs = line->distant_refs;
+            ref->last_ref = line->last & LAST_MASK;
+            ref->last_kind = line->last >> 62;
+            if (sample_max_ > 0)
+                grain->sample_heap.push(std::make_pair(hash_tag(line->tag), line->tag));
+        }
+        grain->cur_time() = cur_times[i];
+        if (engine_ == ENGINE_NONE) {
+            if (!order.empty())
+                grain->untracked_last = order.back()->last & LAST_MASK;
+        } else {
+            grain->top[0].rebuild(grain->cache_map);
+            grain->top[1].rebuild(grain->cache_map);
+        }
+    }
+    shard->records = records;
+    shard->skip_records = records;
+    // The next checkpoint rewrites the file, dropping any torn segment.
+    shard->checkpoint_full_bytes = 0;
+    std::cerr << "Resumed shard " << shard->index << " from " << path << " at record "
+              << records << "\n";
+    return true;
+}
+
+bool
+reuse_distance_t::parallel_shard_supported()
+{
+    return true;
+}
+
+void *
+reuse_distance_t::parallel_shard_init(int shard_index, void *worker_data)
+{
+    auto shard = create_indexed_shard(shard_index);
+    std::lock_guard<std::mutex> guard(shard_map_mutex_);
+    shard_map_[shard_index] = shard;
+    return reinterpret_cast<void *>(shard);
+}
+
+bool
+reuse_distance_t::parallel_shard_exit(void *shard_data)
+{
+    // Nothing (we read the shard data in print_results).
+    return true;
+}
+
+std::string
+reuse_distance_t::parallel_shard_error(void *shard_data)
+{
+    shard_data_t *shard = reinterpret_cast<shard_data_t *>(shard_data);
+    return shard->error;
+}
+
+bool
+reuse_distance_t::start_record(shard_data_t *shard, const memref_t &memref)
+{
+    if (shard->skip_records > 0) {
+        --shard->skip_records;
+        return false;
+    }
+    if (checkpoint_records_ > 0 && shard->records > 0 &&
+        shard->records % checkpoint_records_ == 0)
+        save_checkpoint(shard);
+    ++shard->records;
+    if (stats_usec_ > 0 && shard->records % STATS_CHECK_RECORDS == 0)
+        emit_stats(shard, false);
+    if (DEBUG_VERBOSE(3)) {
+        std::cerr << " ::" << memref.data.pid << "." << memref.data.tid
+                  << ":: " << trace_type_names[memref.data.type];
+        if (memref.data.type != TRACE_TYPE_THREAD_EXIT) {
+            std::cerr << " @ ";
+            if (!type_is_instr(memref.data.type))
+                std::cerr << (void *)memref.data.pc << " ";
+            std::cerr << (void *)memref.data.addr << " x" << memref.data.size;
+        }
+        std::cerr << std::endl;
+    }
+    if (memref.data.type == TRACE_TYPE_THREAD_EXIT) {
+        for (size_t i = 0; i < shard->grains(); ++i)
+            shard->grain(i)->tid = memref.exit.tid;
+        return false;
+    }
+    if (memref.marker.type == TRACE_TYPE_MARKER) {
+        if (memref.marker.marker_type == TRACE_MARKER_TYPE_TIMESTAMP) {
+            shard->last_usec = memref.marker.marker_value;
+            if (!serial_)
+                shard->start_chunk(shard->last_usec);
+            if (shard->interval_start_usec == 0)
+                shard->interval_start_usec = shard->last_usec;
+            else if (interval_usec_ > 0 &&
+                     shard->last_usec - shard->interval_start_usec >= interval_usec_)
+                emit_interval(shard);
+        }
+        return false;
+    }
+    return true;
+}
+
+void
+reuse_distance_t::process_data_access(shard_data_t *shard, const memref_t &memref)
+{
+    access_kind_t kind = type_is_prefetch(memref.data.type) ? ACCESS_PREFETCH
+        : memref.data.type == TRACE_TYPE_WRITE             ? ACCESS_WRITE
+                                                            : ACCESS_READ;
+    if (shard->sharing_log && kind != ACCESS_PREFETCH &&
+        // Sampling keeps whole lines, so a kept line's sharing is exact.
+        (!sampling_ || hash_tag(memref.data.addr >> line_size_bits_) < sample_threshold_ ||
+         hash_tag((memref.data.addr + std::max<size_t>(memref.data.size, 1) - 1) >>
+                  line_size_bits_) < sample_threshold_)) {
+        shard->sharing_log->add(
+            memref.data.addr, kind,
+            static_cast<uint16_t>(std::min<size_t>(memref.data.size, UINT16_MAX)));
+    }
+    account_access(shard, memref.data.addr, memref.data.size, memref.data.pc, kind);
+}
+
+void
+reuse_distance_t::account_access(shard_data_t *shard, addr_t addr, size_t size, addr_t pc,
+                                 access_kind_t kind)
+{
+    for (size_t i = 0; i < shard->grains(); ++i)
+        process_access(shard->grain(i), addr, size, pc, kind);
+    if (shard->set_model) {
+        addr_t last = (addr + std::max<size_t>(size, 1) - 1) >> line_size_bits_;
+        for (addr_t line = addr >> line_size_bits_; line <= last; ++line)
+            shard->set_model->access(line);
+    }
+    if (interval_refs_ > 0 && shard->cur_ref - shard->interval_start_ref >= interval_refs_)
+        emit_interval(shard);
+}
+
+void
+reuse_distance_t::process_access(shard_data_t *shard, addr_t addr, size_t size, addr_t pc,
+                                 access_kind_t kind)
+{
+    if (shard->line_bits == 0) {
+        process_line(shard, addr, pc, kind);
+        return;
+    }
+    // Each tag the access touches counts as an access of its own.
+    addr_t last = (addr + std::max<size_t>(size, 1) - 1) >> shard->line_bits;
+    for (addr_t tag = addr >> shard->line_bits; tag <= last; ++tag)
+        process_line(shard, tag, pc, kind);
+}
+
+// The reuse_kind_t of each [previous][current] access_kind_t pair.
+static const uint8_t REUSE_KIND_OF[3][3] = {
+    { REUSE_RAR, REUSE_WAR, REUSE_PREFETCH },
+    { REUSE_RAW, REUSE_WAW, REUSE_PREFETCH },
+    { REUSE_PREFETCH_HIT, REUSE_PREFETCH_HIT, REUSE_PREFETCH },
+};
+
+int_least64_t
+reuse_distance_t::process_line(shard_data_t *shard, addr_t tag, addr_t pc,
+                               access_kind_t kind)
+{
+    ++shard->total_refs;
+    ++shard->cur_ref;
+    uint64_t sample_hash = 0;
+    if (sampling_) {
+        sample_hash = hash_tag(tag);
+        if (sample_hash >= shard->sample_threshold)
+            return -2;
+    }
+    int_least64_t weight = shard->sample_weight;
+    shard->sampled_refs += weight;
+    line_ref_t *ref = shard->cache_map.find(tag);
+    int_least64_t dist = -1;
+    if (ref == NULL) {
+        ref = shard->line_pool.alloc(tag);
+        // insert into the map
+        shard->cache_map.insert(tag, ref);
+        // insert into the list
+        if (shard->ref_tree)
+            shard->ref_tree->add_to_front(ref);
+        else if (shard->ref_list)
+            shard->ref_list->add_to_front(ref);
+        else {
+            ++shard->untracked_time;
+            shard->untracked_last = shard->cur_ref;
+        }
+        if (sample_max_ > 0)
+            shard->sample_heap.push(std::make_pair(sample_hash, tag));
+        shard->first_touches += weight; // 记录第一次插入或者只执行一次的
+        shard->first_hist.add(shard->cur_ref, weight);
+    } else if (!shard->ref_tree && !shard->ref_list) {
+        ++ref->total_refs;
+        if (ref->last_ref != shard->untracked_last)
+            ++shard->untracked_time;
+        shard->untracked_last = shard->cur_ref;
+        ++shard->sampled_reuses;
+        shard->time_hist.add(shard->cur_ref - ref->last_ref, weight);
+    } else {
+        dist = shard->ref_tree
+            ? shard->ref_tree->move_to_front(ref)
+            : shard->ref_list->move_to_front(ref);
+        ++shard->sampled_reuses;
+        // A distance among sampled lines stands for weight times as many lines.
+        dist *= weight;
+        shard->dist_hist.add(dist, weight);
+        shard->kind_hist[REUSE_KIND_OF[ref->last_kind][kind]].add(dist, weight);
+        if (DEBUG_VERBOSE(3)) {
+            std::cerr << "Distance is " << dist << "\n";
+        }
+        shard->time_hist.add(shard->cur_ref - ref->last_ref, weight);
+        if (shard->pcs)
+            shard->pcs->add(pc, dist, weight, dist >= (int_least64_t)shard->reuse_threshold);
+    }
+    ref->last_ref = shard->cur_ref;
+    ref->last_kind = kind;
+    if (checkpoint_records_ > 0 && !ref->dirty) {
+        ref->dirty = 1;
+        shard->dirty_tags.push_back(tag);
+    }
+    // hotl has no distant references to rank, so it keeps no tables.
+    if (engine_ != ENGINE_NONE) {
+        shard->top[0].update(ref);
+        shard->top[1].update(ref);
+    }
+    if (shard->shared_log) {
+        uint8_t flags = kind;
+        if (dist >= 0) {
+            flags |= shared_log_t::PRIVATE_REUSE;
+            if (dist < (int_least64_t)shard->reuse_threshold)
+                flags |= shared_log_t::PRIVATE_NEAR;
+        }
+        shard->shared_log->add(tag, flags);
+    }
+    if (sample_max_ > 0 && shard->cache_map.size() > sample_max_)
+        shard->shrink_sample(sample_max_);
+    return dist;
+}
+
+void
+reuse_distance_t::emit_interval(shard_data_t *shard)
+{
+    // The interval is the difference between the running histograms and the
+    // snapshot taken at the previous record, so nothing is reset.
+    std::ostringstream record;
+    for (size_t i = 0; i < shard->grains(); ++i) {
+        shard_data_t *grain = shard->grain(i);
+        log_histogram_t dist_hist = grain->dist_hist;
+        log_histogram_t time_hist = grain->time_hist;
+        if (grain->interval_dist_base) {
+            dist_hist.subtract(*grain->interval_dist_base);
+            time_hist.subtract(*grain->interval_time_base);
+            *grain->interval_dist_base = grain->dist_hist;
+            *grain->interval_time_base = grain->time_hist;
+        } else {
+            grain->interval_dist_base.reset(new log_histogram_t(grain->dist_hist));
+            grain->interval_time_base.reset(new log_histogram_t(grain->time_hist));
+        }
+        record << shard->index << " " << grain->line_bits << " " << shard->interval_count
+               << " " << grain->cur_ref - grain->interval_start_ref << " " << grain->cur_ref
+               << " " << shard->last_usec << " "
+               << grain->first_touches - grain->interval_first_touches << " "
+               << dist_hist.count() << " " << dist_hist.mean() << " "
+               << dist_hist.percentile(0.5) << " " << dist_hist.percentile(0.9) << " "
+               << dist_hist.percentile(0.99) << " " << time_hist.mean();
+        for (uint64_t count : dist_hist.octaves())
+            record << " " << count;
+        record << "\n";
+        grain->interval_start_ref = grain->cur_ref;
+        grain->interval_first_touches = grain->first_touches;
+    }
+    ++shard->interval_count;
+    shard->interval_start_usec = shard->last_usec;
+    std::lock_guard<std::mutex> guard(interval_mutex_);
+    fputs(record.str().c_str(), interval_file_);
+}
+
+reuse_distance_t::shard_data_t *
+reuse_distance_t::serial_shard(const memref_t &memref)
+{
+    // For serial operation we index using the tid.
+    shard_data_t *shard;
+    serial_ = true;
+    const auto &lookup = shard_map_.find(memref.data.tid);
+    if (lookup == shard_map_.end()) {
+        shard = create_indexed_shard(memref.data.tid);
+        shard_map_[memref.data.tid] = shard;
+    } else
+        shard = lookup->second;
+    if ((shared_ || sharing_) && shard != serial_shard_) {
+        serial_shard_ = shard;
+        shard->start_chunk(++serial_chunks_);
+    }
+    return shard;
+}
+
+// The chance that a reuse at stack distance dist hits in an LRU cache of
+// sets sets and assoc ways when lines land in sets at random: it hits unless
+// assoc or more of the dist lines touched since went to its set.
+static double
+set_assoc_hit_ratio(double dist, uint64_t sets, int assoc)
+{
+    if (sets <= 1)
+        return dist < assoc ? 1. : 0.;
+    double p = 1. / sets;
+    // Sum the binomial(dist, p) terms for 0 .. assoc-1 lines in the set.
+    double term = std::exp(dist * std::log1p(-p));
+    double hit = term;
+    for (int k = 0; k + 1 < assoc && k < dist; ++k) {
+        term *= (dist - k) / (k + 1) * p / (1 - p);
+        hit += term;
+    }
+    return std::min(hit, 1.);
+}
+
+// The miss ratio curves run from 1K to 1G bytes, doubling.
+static const int MRC_SIZES = 21;
+
+static std::string
+size_label(uint64_t bytes)
+{
+    if (bytes >= (1 << 30))
+        return std::to_string(bytes >> 30) + "G";
+    if (bytes >= (1 << 20))
+        return std::to_string(bytes >> 20) + "M";
+    return std::to_string(bytes >> 10) + "K";
+}
+
+// The higher-order theory of locality (Xiang et al., ASPLOS 2013): the mean
+// footprint fp(w) over all windows of w references follows from the reuse
+// times and the lines' first and last access times alone, in linear time,
+// and a cache of fp(w) lines misses fp(w + 1) - fp(w) of the accesses.
+void
+reuse_distance_t::compute_footprint_misses(shard_data_t *shard)
+{
+    double n = static_cast<double>(shard->cur_ref);
+    double m = static_cast<double>(shard->unique_lines());
+    if (shard->cur_ref == 0)
+        return;
+    // fp(w) = m - S(w) / (n - w + 1), where S(w) sums x - w over every x > w
+    // among the reuse times, the first access times and each line's time from
+    // its last access to the end, n + 1 - last.  Each of these goes in one
+    // histogram; below[i] and below_sum[i] total the counts and the values
+    // (bucket midpoints) of the buckets from i up.
+    log_histogram_t times = shard->time_hist;
+    times.merge(shard->first_hist);
+    for (const auto &entry : shard->cache_map)
+        times.add(shard->cur_ref + 1 - entry.second->last_ref, shard->sample_weight);
+    std::vector<double> above(times.buckets() + 1, 0.);
+    std::vector<double> above_sum(times.buckets() + 1, 0.);
+    for (size_t i = times.buckets(); i-- > 0;) {
+        double count = static_cast<double>(times.bucket_count(i));
+        above[i] = above[i + 1] + count;
+        above_sum[i] =
+            above_sum[i + 1] + count * (times.bucket_low(i) + (times.bucket_width(i) - 1) / 2.);
+    }
+    // C(w), the count of the x > w, and S(w), with w's own bucket taken as
+    // evenly spread.
+    auto sums = [&](uint64_t w, double *count, double *sum) {
+        size_t i = times.bucket(w);
+        double last = static_cast<double>(times.bucket_low(i) + times.bucket_width(i) - 1);
+        double part = times.bucket_count(i) * (last - w) / times.bucket_width(i);
+        *count = above[i + 1] + part;
+        *sum = above_sum[i + 1] + part * (w + 1 + last) / 2. - w * *count;
+    };
+    auto footprint = [&](uint64_t w) {
+        double count, sum;
+        sums(w, &count, &sum);
+        return m - sum / (n - w + 1);
+    };
+    // fp(w + 1) - fp(w), with S(w + 1) = S(w) - C(w).  First touches miss
+    // in any cache.
+    double cold_ratio = shard->first_touches / n;
+    auto miss_ratio = [&](uint64_t w) {
+        double count, sum;
+        sums(w, &count, &sum);
+        double d = n - w + 1;
+        return std::min(std::max(count / (d - 1) - sum / (d * (d - 1)), cold_ratio), 1.);
+    };
+    // The buckets' midpoints put S(w) within a few percent, but the error is
+    // divided by n - w + 1, so windows stop at half the trace.  Caches between
+    // that footprint and every line interpolate down to the first touches.
+    uint64_t max_window = shard->cur_ref / 2;
+    double max_footprint = footprint(max_window);
+    double max_ratio = miss_ratio(max_window);
+    uint64_t line_bytes = static_cast<uint64_t>(1) << shard->line_bits;
+    shard->footprint_misses.assign(MRC_SIZES, 0.);
+    for (int i = 0; i < MRC_SIZES; ++i) {
+        double lines = static_cast<double>((static_cast<uint64_t>(1) << (10 + i)) / line_bytes);
+        if (lines == 0)
+            continue;
+        if (lines >= max_footprint) {
+            double ratio = lines >= m
+                ? cold_ratio
+                : max_ratio +
+                    (cold_ratio - max_ratio) * (lines - max_footprint) / (m - max_footprint);
+            shard->footprint_misses[i] = ratio * n;
+            continue;
+        }
+        // The footprint only grows with the window, so binary search the
+        // window whose footprint fills the cache.
+        uint64_t low = 0, high = max_window;
+        while (low + 1 < high) {
+            uint64_t mid = low + (high - low) / 2;
+            if (footprint(mid) < lines)
+                low = mid;
+            else
+                high = mid;
+        }
+        shard->footprint_misses[i] = miss_ratio(low) * n;
+    }
+}
+
+void
+reuse_distance_t::print_miss_ratio_curve(const shard_data_t *shard)
+{
+    const log_histogram_t &dist_hist = shard->dist_hist;
+    double accesses = static_cast<double>(dist_hist.count() + shard->first_touches);
+    bool distances = engine_ != ENGINE_NONE;
+    bool footprint = !shard->footprint_misses.empty() && shard->cur_ref > 0;
+    if (accesses == 0 && !footprint)
+        return;
+    // Finer tags would count every address in a line as a line of its own.
+    if (shard->line_bits < static_cast<int>(line_size_bits_)) {
+        std::cerr << "(No miss ratio curve: tags are "
+                  << (shard->line_bits == 0
+                          ? std::string("byte addresses")
+                          : std::to_string(static_cast<uint64_t>(1) << shard->line_bits) +
+                              "-byte units")
+                  << "; ";
+        if (*std::max_element(line_shifts_.begin(), line_shifts_.end()) >=
+            static_cast<int>(line_size_bits_))
+            std::cerr << "see the coarser granularity.)\n";
+        else {
+            std::cerr << "set WPC_LINE_SHIFTS to include " << line_size_bits_ << " for "
+                      << knobs_.line_size << "-byte lines.)\n";
+        }
+        return;
+    }
+    uint64_t line_bytes = static_cast<uint64_t>(1) << shard->line_bits;
+    std::cerr << "Miss ratio curve (LRU, " << line_bytes << "-byte lines):\n";
+    std::cerr << std::setw(10) << "Cache size" << std::setw(12) << "Lines";
+    if (distances)
+        std::cerr << std::setw(14) << "Fully assoc";
+    if (distances && mrc_assoc_ > 0)
+        std::cerr << std::setw(10) << mrc_assoc_ << "-way";
+    if (footprint)
+        std::cerr << std::setw(14) << "Footprint";
+    std::cerr << "\n";
+    for (int i = 0; i < MRC_SIZES; ++i) {
+        uint64_t bytes = static_cast<uint64_t>(1) << (10 + i);
+        uint64_t lines = bytes / line_bytes;
+        if (lines == 0)
+            continue;
+        std::cerr << std::setw(10) << size_label(bytes) << std::setw(12) << lines;
+        // A reuse hits in a fully associative cache of n lines when fewer
+        // than n other lines were touched since; first touches always miss.
+        if (distances) {
+            double misses = accesses - dist_hist.count_below(lines);
+            std::cerr << std::setw(13) << misses / accesses * 100. << "%";
+        }
+        if (distances && mrc_assoc_ > 0) {
+            uint64_t sets = std::max<uint64_t>(lines / mrc_assoc_, 1);
+            double hits = 0;
+            for (size_t i = 0; i < dist_hist.buckets(); ++i) {
+                uint64_t bucket_count = dist_hist.bucket_count(i);
+                if (bucket_count == 0)
+                    continue;
+                // The bucket's midpoint stands for all of its distances.
+                double dist =
+                    dist_hist.bucket_low(i) + (dist_hist.bucket_width(i) - 1) / 2.;
+                hits += bucket_count * set_assoc_hit_ratio(dist, sets, mrc_assoc_);
+            }
+            std::cerr << std::setw(14) << (accesses - hits) / accesses * 100. << "%";
+        }
+        if (footprint) {
+            std::cerr << std::setw(13) << shard->footprint_misses[i] / shard->cur_ref * 100.
+                      << "%";
+        }
+        std::cerr << "\n";
+    }
+}
+
+void
+reuse_distance_t::print_set_results(const shard_data_t *shard)
+{
+    const set_model_t *model = shard->set_model.get();
+    if (model == NULL || model->refs == 0)
+        return;
+    double refs = static_cast<double>(model->refs);
+    std::cerr << "Set-associative model (" << size_label(model->sets() * model->ways() *
+                                                          knobs_.line_size)
+              << ": " << model->sets() << " sets of " << model->ways() << " ways, "
+              << knobs_.line_size << "-byte lines, LRU):\n";
+    std::cerr << "Misses: " << model->misses << " set-assoc (" << model->misses / refs * 100.
+              << "%), " << model->full_misses << " fully assoc ("
+              << model->full_misses / refs * 100. << "%), gap "
+              << (static_cast<double>(model->misses) - model->full_misses) / refs * 100.
+              << "%\n";
+    std::cerr << "Conflict misses (hits when fully assoc): " << model->conflicts << " ("
+              << model->conflicts / refs * 100. << "% of accesses)\n";
+
+    // The imbalance: how many sets see what multiple of the mean accesses.
+    static const char *const labels[] = { "0",       "< 1/4", "1/4 - 1/2", "1/2 - 1",
+                                          "1 - 2",   "2 - 4", "4 - 8",     ">= 8" };
+    static const size_t LEVELS = sizeof(labels) / sizeof(labels[0]);
+    std::vector<uint64_t> levels(LEVELS, 0);
+    double mean = refs / model->sets();
+    for (uint64_t set = 0; set < model->sets(); ++set) {
+        double share = model->set_refs[set] / mean;
+        size_t level = model->set_refs[set] == 0
+            ? 0
+            : std::min<size_t>(LEVELS - 1, std::max<int>(1, std::floor(std::log2(share)) + 4));
+        ++levels[level];
+    }
+    std::cerr << "Sets by accesses over the mean of " << mean << ":\n";
+    for (size_t level = 0; level < LEVELS; ++level) {
+        std::cerr << std::setw(12) << labels[level] << std::setw(12) << levels[level]
+                  << std::setw(8) << levels[level] * 100. / model->sets() << "%\n";
+    }
+
+    std::vector<uint64_t> hottest(model->sets());
+    for (uint64_t set = 0; set < model->sets(); ++set)
+        hottest[set] = set;
+    size_t shown = std::min<size_t>(knobs_.report_top, hottest.size());
+    std::partial_sort(hottest.begin(), hottest.begin() + shown, hottest.end(),
+                      [model](uint64_t l, uint64_t r) {
+                          if (model->set_conflicts[l] != model->set_conflicts[r])
+                              return model->set_conflicts[l] > model->set_conflicts[r];
+                          if (model->set_misses[l] != model->set_misses[r])
+                              return model->set_misses[l] > model->set_misses[r];
+                          return l < r;
+                      });
+    std::cerr << "Top " << shown << " sets by conflict misses\n";
+    std::cerr << std::setw(10) << "set" << std::setw(14) << "accesses" << std::setw(14)
+              << "misses" << std::setw(10) << "miss %" << std::setw(14) << "conflicts"
+              << "\n";
+    for (size_t i = 0; i < shown; ++i) {
+        uint64_t set = hottest[i];
+        std::cerr << std::setw(10) << set << std::setw(14) << model->set_refs[set]
+                  << std::setw(14) << model->set_misses[set] << std::setw(9)
+                  << (model->set_refs[set] == 0
+                          ? 0.
+                          : model->set_misses[set] * 100. / model->set_refs[set])
+                  << "%" << std::setw(14) << model->set_conflicts[set] << "\n";
+    }
+}
+
+std::string
+reuse_distance_t::symbolize(addr_t pc) const
+{
+    std::ostringstream name;
+    name << std::hex << std::showbase;
+    auto it = std::upper_bound(modules_.begin(), modules_.end(), pc,
+                               [](addr_t pc, const module_range_t &range) {
+                                   return pc < range.start;
+                               });
+    if (it != modules_.begin() && pc < (it - 1)->end) {
+        --it;
+        size_t slash = it->path.find_last_of('/');
+        name << it->path.substr(slash == std::string::npos ? 0 : slash + 1) << "+"
+             << pc - it->start + it->offset;
+    } else
+        name << pc;
+    return name.str();
+}
+
+void
+reuse_distance_t::print_pc_results(const shard_data_t *shard)
+{
+    if (!shard->pcs || shard->pcs->entries().empty())
+        return;
+    typedef pc_summary_t::entry_t entry_t;
+    const pc_summary_t &pcs = *shard->pcs;
+    // The mean counts a reuse at distance d as d + 1 lines, as above, over the
+    // reuses seen since the pc took its entry.
+    auto mean_dist = [](const entry_t *entry) {
+        uint64_t seen = entry->reuses - entry->error;
+        return seen == 0 ? 0. : static_cast<double>(entry->dist_sum + seen) / seen;
+    };
+    auto print_rows = [&](const std::vector<const entry_t *> &top, size_t shown) {
+        std::cerr << std::setw(18) << "pc"
+                  << ": " << std::setw(12) << "#reuses" << std::setw(14) << "overcount"
+                  << std::setw(14) << "#distant" << std::setw(14) << "mean dist"
+                  << (modules_.empty() ? "" : "  module+offset") << "\n";
+        for (size_t i = 0; i < shown; ++i) {
+            std::cerr << std::setw(18) << std::hex << std::showbase << top[i]->pc << ": "
+                      << std::dec << std::setw(12) << top[i]->reuses << std::setw(14)
+                      << top[i]->error << std::setw(14) << top[i]->distant
+                      << std::setw(14) << mean_dist(top[i]);
+            if (!modules_.empty())
+                std::cerr << "  " << symbolize(top[i]->pc);
+            std::cerr << "\n";
+        }
+    };
+    std::vector<const entry_t *> top;
+    for (const entry_t &entry : pcs.entries())
+        top.push_back(&entry);
+    size_t shown = std::min<size_t>(knobs_.report_top, top.size());
+    std::partial_sort(top.begin(), top.begin() + shown, top.end(),
+                      [](const entry_t *l, const entry_t *r) {
+                          if (l->distant != r->distant)
+                              return l->distant > r->distant;
+                          if (l->reuses != r->reuses)
+                              return l->reuses > r->reuses;
+                          return l->pc < r->pc;
+                      });
+    std::cerr << "Top " << shown << " instructions by distant reuses (" << top.size()
+              << " of " << pcs.capacity() << " tracking entries used)\n";
+    print_rows(top, shown);
+
+    // Only pcs seen for more than their share of one entry have a mean worth
+    // ranking; any pc with that many reuses is sure to be tracked.
+    uint64_t min_seen = std::max<uint64_t>(pcs.total() / pcs.capacity(), 1);
+    top.erase(std::remove_if(top.begin(), top.end(),
+                             [min_seen](const entry_t *entry) {
+                                 return entry->reuses - entry->error < min_seen;
+                             }),
+              top.end());
+    shown = std::min<size_t>(knobs_.report_top, top.size());
+    std::partial_sort(top.begin(), top.begin() + shown, top.end(),
+                      [&mean_dist](const entry_t *l, const entry_t *r) {
+                          double l_mean = mean_dist(l);
+                          double r_mean = mean_dist(r);
+                          if (l_mean != r_mean)
+                              return l_mean > r_mean;
+                          return l->pc < r->pc;
+                      });
+    std::cerr << "Top " << shown << " instructions by mean reuse distance (at least "
+              << min_seen << " reuses)\n";
+    print_rows(top, shown);
+}
+
+void
+reuse_distance_t::print_kind_results(const shard_data_t *shard)
+{
+    static const char *const names[REUSE_KINDS] = {
+        "read after read",   "read after write", "write after read",
+        "write after write", "prefetch hit",     "prefetch reuse",
+    };
+    uint64_t count = shard->dist_hist.count();
+    if (count == 0)
+        return;
+    // Distant reuses of a written line (RAW, WAW) are the dirty lines a cache
+    // of the threshold size would have had to write back.
+    std::cerr << "Reuse distance by access type:\n";
+    std::cerr << std::setw(18) << "type" << std::setw(12) << "reuses" << std::setw(9)
+              << "share" << std::setw(12) << "mean" << std::setw(10) << "p50"
+              << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(12)
+              << "distant"
+              << "\n";
+    for (int kind = 0; kind < REUSE_KINDS; ++kind) {
+        const log_histogram_t &hist = shard->kind_hist[kind];
+        if (hist.count() == 0)
+            continue;
+        std::cerr << std::setw(18) << names[kind] << std::setw(12) << hist.count()
+                  << std::setw(8) << hist.count() * 100. / count << "%" << std::setw(12)
+                  << hist.mean() + 1 << std::setw(10) << hist.percentile(0.5)
+                  << std::setw(10) << hist.percentile(0.9) << std::setw(10)
+                  << hist.percentile(0.99) << std::setw(12)
+                  << hist.count_between(knobs_.distance_threshold, UINT64_MAX) << "\n";
+    }
+}
+
+void
+reuse_distance_t::print_shard_results(const shard_data_t *shard)
+{
+    std::cerr << "Total accesses: " << shard->total_refs << "\n";
+    std::cerr << "Unique accesses: " << shard->cur_time() * shard->sample_weight << "\n";
+    std::cerr << "Unique cache lines accessed: " << shard->unique_lines()
+              << (shard->merged_lines > 0 && shard_map_.size() > 1 ? " (summed over shards)"
+                                                                    : "")
+              << "\n";
+    std::cerr << "\n";
+
+    std::cerr.precision(2);
+    std::cerr.setf(std::ios::fixed);
+
+    // With sampling every count below is scaled up by the sample weight.  The
+    // histogram error is dominated by how many distinct lines were sampled; we
+    // report the 95% bound on a cumulative fraction, largest at 50%.
+    if (sampling_) {
+        size_t sampled_lines = std::max<size_t>(shard->sampled_lines(), 1);
+        double sample_error = 1.96 * std::sqrt(0.25 / sampled_lines);
+        int_least64_t estimated_refs = shard->sampled_refs;
+        std::cerr << "SHARDS sampling rate: 1/" << shard->sample_weight << "\n";
+        std::cerr << "Sampled cache lines: " << shard->sampled_lines()
+                  << ", sampled reuses: " << shard->sampled_reuses << "\n";
+        std::cerr << "Sampled accesses scaled: " << estimated_refs << " ("
+                  << (estimated_refs - shard->total_refs) * 100. /
+                std::max<int_least64_t>(shard->total_refs, 1)
+                  << "% off the actual total)\n";
+        std::cerr << "Estimated histogram error: +/-" << sample_error * 100.
+                  << "% cumulative (95% confidence)\n";
+        std::cerr << "\n";
+    }
+
+    // The sum and mean count a reuse at distance d as d + 1 lines touched.
+    const log_histogram_t &dist_hist = shard->dist_hist;
+    int_least64_t count = dist_hist.count();
+    double sum = static_cast<double>(dist_hist.sum() + count);
+    if (engine_ == ENGINE_NONE)
+        std::cerr << "(No reuse distances with WPC_REUSE_ENGINE=hotl: reuse times only.)\n";
+    else {
+        std::cerr << "Reuse distance sum: " << sum << "\n";
+        std::cerr << "Reuse distance mean: " << (count == 0 ? 0. : sum / count) << "\n";
+        std::cerr << stream_.count_label << ": " << count << "\n";
+        if (count > 0)
+            std::cerr << "Reuse distance median: " << dist_hist.percentile(0.5) << "\n";
+        std::cerr << "Reuse distance standard deviation: " << dist_hist.stddev() << "\n";
+        std::cerr << "Reuse distance percentiles: p90 " << dist_hist.percentile(0.9)
+                  << ", p99 " << dist_hist.percentile(0.99) << ", p99.9 "
+                  << dist_hist.percentile(0.999) << "\n";
+    }
+    print_miss_ratio_curve(shard);
+    print_set_results(shard);
+    // Fetches are all reads, so only data accesses split by type.
+    if (stream_.data)
+        print_kind_results(shard);
+
+    printf("====> Instruction Reuse Distance <====\n");
+    // std::cout<< "====> Instruction Reuse Distance <====\n" << std::endl;
+    // The log-linear buckets fold exactly into these power-of-two rows.
+    const log_histogram_t &time_hist = shard->time_hist;
+    uint64_t le = 1;
+    uint64_t ri = 2;
+    for (int i = 0; i < stream_.time_rows; ++i) {
+        printf("[%8lu, %8lu): %lu\n", le, ri, time_hist.count_between(le, ri));
+        le *= 2;
+        ri *= 2;
+    }
+    printf("[%8lu, %8s): %lu\n", le, "inf", time_hist.count_between(le, UINT64_MAX));
+    printf("[%8s]: %lu\n", "the total number of instruction key", shard->first_touches);
+    printf("[%8s]: %lu\n", "the total number of reuse data num", time_hist.count());
+    printf("[%8s]: %lu\n", "the total number of instruction counter",
+            shard->cur_ref);
+    printf("%8s: %f\n", "the stdev of reuse dist is", time_hist.stddev());
+    printf("%8s: %f\n", "the mean of reuse dist is", time_hist.mean());
+
+    if (knobs_.report_histogram) {
+        std::cerr << "Reuse distance histogram:\n";
+        std::cerr << "Distance" << std::setw(12) << "Count"
+                  << "  Percent  Cumulative" << (sampling_ ? "   +/-" : "") << "\n";
+        double cum_percent = 0;
+        size_t sampled_lines = std::max<size_t>(shard->sampled_lines(), 1);
+        // One row per non-empty bucket, labelled with its smallest distance.
+        for (size_t i = 0; i < dist_hist.buckets(); ++i) {
+            uint64_t bucket_count = dist_hist.bucket_count(i);
+            if (bucket_count == 0)
+                continue;
+            double percent = bucket_count / static_cast<double>(count);
+            cum_percent += percent;
+            std::cerr << std::setw(8) << dist_hist.bucket_low(i) + 1 << std::setw(12)
+                      << bucket_count
+                      << std::setw(8) << percent * 100. << "%" << std::setw(8)
+                      << cum_percent * 100. << "%";
+            if (sampling_) {
+                double fraction = std::min(cum_percent, 1.);
+                std::cerr << std::setw(8)
+                          << 1.96 * std::sqrt(fraction * (1 - fraction) / sampled_lines) *
+                        100.
+                          << "%";
+            }
+            std::cerr << "\n";
+        }
+    } else {
+        std::cerr << "(Pass -reuse_distance_histogram to see all the data.)\n";
+    }
+
+    std::cerr << "\n";
+    if (engine_ == ENGINE_NONE) {
+        std::cerr << "(No top cache line tables with WPC_REUSE_ENGINE=hotl.)\n";
+        print_pc_results(shard);
+        return;
+    }
+    std::cerr << "Reuse distance threshold = " << knobs_.distance_threshold
+              << " cache lines\n";
+    if (sampling_)
+        std::cerr << "(The tables below cover sampled cache lines only.)\n";
+    static const char *const titles[2] = { "frequently referenced",
+                                           "distant repeatedly referenced" };
+    for (int table = 0; table < 2; ++table) {
+        std::cerr << "Top " << knobs_.report_top << " " << titles[table]
+                  << " cache lines\n";
+        std::cerr << std::setw(18) << "cache line"
+                  << ": " << std::setw(17) << "#references  " << std::setw(14)
+                  << "#distant refs"
+                  << "\n";
+        if (!shard->top[table].exact()) {
+            std::cerr << "(Merged from the shards' top " << knobs_.report_top * TOP_LINES_TRACKED
+                      << ": a line outside all of them could still belong here.)\n";
+        }
+        std::vector<line_ref_t *> lines = shard->top[table].sorted();
+        lines.resize(std::min<size_t>(lines.size(), knobs_.report_top));
+        for (const line_ref_t *ref : lines) {
+            std::cerr << std::setw(18) << std::hex << std::showbase
+                      << (ref->tag << shard->line_bits) << ": " << std::setw(12) << std::dec
+                      << ref->total_refs << ", " << std::setw(12) << std::dec
+                      << ref->distant_refs << "\n";
+        }
+    }
+    print_pc_results(shard);
+}
+
+void
+reuse_distance_t::fill_result_record(const shard_data_t *shard, int_least64_t index,
+                                     const reuse_result_header_t *header,
+                                     reuse_result_record_t *record)
+{
+    memset(record, 0, header->record_size);
+    record->shard = index;
+    record->tid = shard->tid;
+    record->total_refs = shard->total_refs;
+    record->unique_accesses = shard->cur_time() * shard->sample_weight;
+    record->unique_lines = shard->unique_lines();
+    record->first_touches = shard->first_touches;
+    record->sample_weight = shard->sample_weight;
+    record->line_bits = shard->line_bits;
+    record->dist_count = shard->dist_hist.count();
+    record->time_count = shard->time_hist.count();
+    reuse_result_set128(record->dist_sum, shard->dist_hist.sum());
+    reuse_result_set128(record->dist_sqsum, shard->dist_hist.sqsum());
+    reuse_result_set128(record->time_sum, shard->time_hist.sum());
+    reuse_result_set128(record->time_sqsum, shard->time_hist.sqsum());
+    uint64_t *dist_hist = reuse_result_dist_hist(record);
+    uint64_t *time_hist = reuse_result_time_hist(record, header);
+    for (size_t i = 0; i < header->hist_buckets; ++i) {
+        dist_hist[i] = shard->dist_hist.bucket_count(i);
+        time_hist[i] = shard->time_hist.bucket_count(i);
+    }
+    for (int table = 0; table < 2; ++table) {
+        reuse_result_line_t *lines = reuse_result_top(record, header, table);
+        std::vector<line_ref_t *> top = shard->top[table].sorted();
+        top.resize(std::min<size_t>(top.size(), header->top_lines));
+        for (const line_ref_t *ref : top) {
+            lines->addr = ref->tag << shard->line_bits;
+            lines->total_refs = ref->total_refs;
+            lines->distant_refs = ref->distant_refs;
+            ++lines;
+        }
+    }
+}
+
+bool
+reuse_distance_t::write_result_file(const shard_data_t *aggregate)
+{
+    reuse_result_header_t header;
+    reuse_result_header_init(&header, aggregate->dist_hist.sub_bits(),
+                             static_cast<uint32_t>(aggregate->dist_hist.buckets()),
+                             knobs_.report_top, knobs_.line_size,
+                             knobs_.distance_threshold,
+                             static_cast<uint32_t>(aggregate->grains() *
+                                                   (shard_map_.size() + 1)));
+    FILE *file = fopen(result_path_.c_str(), "wb");
+    if (file == NULL) {
+        error_string_ = "Failed to open result file " + result_path_;
+        return false;
+    }
+    std::vector<uint64_t> buffer(header.record_size / sizeof(uint64_t));
+    reuse_result_record_t *record = reinterpret_cast<reuse_result_record_t *>(buffer.data());
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    // Shards go in index order so equal runs give identical files.
+    std::vector<std::pair<memref_tid_t, shard_data_t *>> shards(shard_map_.begin(),
+                                                                shard_map_.end());
+    std::sort(shards.begin(), shards.end());
+    // Each granularity's aggregate comes first, then its shards.
+    for (size_t i = 0; i < aggregate->grains(); ++i) {
+        fill_result_record(aggregate->grain(i), -1, &header, record);
+        ok = ok && fwrite(record, header.record_size, 1, file) == 1;
+        for (const auto &shard : shards) {
+            fill_result_record(shard.second->grain(i), shard.first, &header, record);
+            ok = ok && fwrite(record, header.record_size, 1, file) == 1;
+        }
+    }
+    ok = fclose(file) == 0 && ok;
+    if (!ok)
+        error_string_ = "Failed to write result file " + result_path_;
+    return ok;
+}
+
+void
+reuse_distance_t::merge_shard(shard_data_t *aggregate, const shard_data_t *shard)
+{
+    aggregate->total_refs += shard->total_refs;
+    aggregate->sampled_refs += shard->sampled_refs;
+    aggregate->sampled_reuses += shard->sampled_reuses;
+    aggregate->cur_ref += shard->cur_ref;
+    aggregate->time_hist.merge(shard->time_hist);
+    aggregate->first_touches += shard->first_touches;
+    // We simply sum the unique accesses.
+    // If the user wants the unique accesses over the merged trace they
+    // can create a single shard and invoke the parallel operations.
+    aggregate->cur_time() += shard->cur_time();
+    // Likewise the unique lines, and the line tables only take the lines in
+    // the shards' own tables (merge_top_lines), so no shard's lines are copied.
+    aggregate->merged_lines += shard->unique_lines();
+    aggregate->merged_sampled_lines += shard->sampled_lines();
+    aggregate->dist_hist.merge(shard->dist_hist);
+    for (int kind = 0; kind < REUSE_KINDS; ++kind)
+        aggregate->kind_hist[kind].merge(shard->kind_hist[kind]);
+    if (aggregate->pcs)
+        aggregate->pcs->merge(*shard->pcs);
+    if (aggregate->set_model && shard->set_model)
+        aggregate->set_model->merge(*shard->set_model);
+    if (!shard->footprint_misses.empty()) {
+        aggregate->footprint_misses.resize(MRC_SIZES, 0.);
+        for (int i = 0; i < MRC_SIZES; ++i)
+            aggregate->footprint_misses[i] += shard->footprint_misses[i];
+    }
+}
+
+void
+reuse_distance_t::merge_top_lines(shard_data_t *aggregate, size_t grain)
+{
+    // A line missing from every shard's tables counts no more than the sum of
+    // the tables' floors, which bounds what the merged tables can have missed.
+    line_map_t candidates;
+    uint64_t floor[2] = { 0, 0 };
+    for (const auto &shard : shard_map_) {
+        const shard_data_t *part = shard.second->grain(grain);
+        for (int table = 0; table < 2; ++table) {
+            floor[table] += part->top[table].floor();
+            for (const line_ref_t *line : part->top[table].lines()) {
+                // With sampling, only lines every shard could have sampled are
+                // comparable.
+                if ((sampling_ && hash_tag(line->tag) >= aggregate->sample_threshold) ||
+                    candidates.find(line->tag) != NULL)
+                    continue;
+                line_ref_t *ref = aggregate->line_pool.alloc(line->tag);
+                ref->total_refs = 0;
+                candidates.insert(line->tag, ref);
+            }
+        }
+    }
+    for (const auto &entry : candidates) {
+        line_ref_t *ref = entry.second;
+        for (const auto &shard : shard_map_) {
+            const line_ref_t *line = shard.second->grain(grain)->cache_map.find(ref->tag);
+            if (line == NULL)
+                continue;
+            ref->total_refs += line->total_refs;
+            ref->distant_refs += line->distant_refs;
+        }
+        aggregate->top[0].update(ref);
+        aggregate->top[1].update(ref);
+    }
+    for (int table = 0; table < 2; ++table) {
+        std::vector<line_ref_t *> lines = aggregate->top[table].sorted();
+        if (lines.empty())
+            continue;
+        const line_ref_t *last =
+            lines[std::min<size_t>(lines.size(), knobs_.report_top) - 1];
+        aggregate->top[table].set_exact(aggregate->top[table].count(last) > floor[table] ||
+                                        floor[table] == 0);
+    }
+}
+
+void
+shared_log_t::spill()
+{
+    if (tags.empty())
+        return;
+    block_header_t header = { chunks.size(), tags.size(), sizes.size() };
+    FILE *file = fopen(path.c_str(), "ab");
+    bool ok = file != NULL && fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(chunks.data(), sizeof(chunk_t), chunks.size(), file) == chunks.size() &&
+        fwrite(tags.data(), sizeof(addr_t), tags.size(), file) == tags.size() &&
+        fwrite(flags.data(), 1, flags.size(), file) == flags.size() &&
+        fwrite(sizes.data(), sizeof(uint16_t), sizes.size(), file) == sizes.size();
+    ok = file != NULL && fclose(file) == 0 && ok;
+    if (ok) {
+        length += sizeof(header) + chunks.size() * sizeof(chunk_t) +
+            tags.size() * (sizeof(addr_t) + 1) + sizes.size() * sizeof(uint16_t);
+    } else
+        failed = true;
+    uint64_t key = chunks.back().key;
+    chunks.assign(1, { key, 0 });
+    tags.clear();
+    flags.clear();
+    sizes.clear();
+}
+
+bool
+shared_log_t::restore(uint64_t key, uint64_t length)
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        if (length != 0)
+            return false;
+    } else if (static_cast<uint64_t>(info.st_size) < length ||
+               truncate(path.c_str(), length) != 0)
+        return false;
+    this->length = length;
+    chunks.assign(1, { key, 0 });
+    tags.clear();
+    flags.clear();
+    sizes.clear();
+    return true;
+}
+
+bool
+log_reader_t::next()
+{
+    // Empty chunks are skipped.
+    while (true) {
+        if (cursor_ + 1 < chunks.size())
+            ++cursor_;
+        else {
+            if (error || offset_ >= log_->length)
+                return false;
+            FILE *file = fopen(log_->path.c_str(), "rb");
+            shared_log_t::block_header_t header;
+            bool ok = file != NULL && fseeko(file, offset_, SEEK_SET) == 0 &&
+                fread(&header, sizeof(header), 1, file) == 1 &&
+                header.entries <= shared_log_t::BUFFER_ENTRIES &&
+                header.chunks <= header.entries + 1 && header.sizes <= header.entries;
+            if (ok) {
+                chunks.resize(header.chunks);
+                tags.resize(header.entries);
+                flags.resize(header.entries);
+                sizes.resize(header.sizes);
+                ok = fread(chunks.data(), sizeof(chunks[0]), chunks.size(), file) ==
+                        chunks.size() &&
+                    fread(tags.data(), sizeof(addr_t), tags.size(), file) == tags.size() &&
+                    fread(flags.data(), 1, flags.size(), file) == flags.size() &&
+                    fread(sizes.data(), sizeof(uint16_t), sizes.size(), file) == sizes.size();
+            }
+            if (file != NULL)
+                fclose(file);
+            if (!ok || chunks.empty()) {
+                error = true;
+                return false;
+            }
+            offset_ += sizeof(header) + chunks.size() * sizeof(chunks[0]) +
+                tags.size() * (sizeof(addr_t) + 1) + sizes.size() * sizeof(uint16_t);
+            cursor_ = 0;
+        }
+        if (end() > begin())
+            return true;
+    }
+}
+
+template <typename visit_t>
+bool
+reuse_distance_t::replay_logs(bool sharing, visit_t visit)
+{
+    // The logs are merged by the key of each one's next chunk, and chunks
+    // with the same key go in shard order, as a sort of all the chunks would
+    // place them.
+    std::vector<std::pair<int_least64_t, std::unique_ptr<log_reader_t>>> readers;
+    bool ok = true;
+    for (const auto &shard : shard_map_) {
+        shared_log_t *log =
+            sharing ? shard.second->sharing_log.get() : shard.second->shared_log.get();
+        log->spill();
+        if (log->failed) {
+            std::cerr << "Failed to write " << log->path << "\n";
+            ok = false;
+        }
+        readers.emplace_back(shard.first, std::unique_ptr<log_reader_t>(new log_reader_t(log)));
+    }
+    typedef std::pair<std::pair<uint64_t, int_least64_t>, size_t> head_t;
+    std::priority_queue<head_t, std::vector<head_t>, std::greater<head_t>> heads;
+    for (size_t i = 0; ok && i < readers.size(); ++i) {
+        if (readers[i].second->next())
+            heads.push({ { readers[i].second->chunk().key, readers[i].first }, i });
+    }
+    while (ok && !heads.empty()) {
+        size_t i = heads.top().second;
+        heads.pop();
+        log_reader_t &reader = *readers[i].second;
+        visit(readers[i].first, reader);
+        if (reader.next())
+            heads.push({ { reader.chunk().key, readers[i].first }, i });
+    }
+    for (const auto &reader : readers) {
+        if (reader.second->error) {
+            std::cerr << "Failed to read back " << reader.second->path() << "\n";
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+void
+reuse_distance_t::print_shared_results()
+{
+    // How each shard's reuses fare once the other shards share the cache.
+    struct interference_t {
+        memref_tid_t tid;
+        uint64_t reuses = 0;         // reuses in the shard's own stream
+        uint64_t private_near = 0;   // of which under the threshold there
+        uint64_t lost = 0;           // of which at or over it when shared
+        uint64_t shared_near = 0;    // under the threshold only when shared
+    };
+    std::map<int_least64_t, interference_t> threads;
+    uint64_t sample_threshold = SAMPLE_MODULUS;
+    int_least64_t total_refs = 0;
+    for (const auto &shard : shard_map_) {
+        threads[shard.first].tid = shard.second->tid;
+        sample_threshold = std::min(sample_threshold, shard.second->sample_threshold);
+        total_refs += shard.second->total_refs;
+    }
+
+    // The whole stream runs through one more shard, with no pcs to attribute.
+    std::unique_ptr<shard_data_t> shared(
+        new shard_data_t(knobs_.distance_threshold, knobs_.skip_list_distance,
+                         knobs_.verify_skip, engine_, hist_bits_,
+                         knobs_.report_top * TOP_LINES_TRACKED));
+    shared->line_bits = line_shifts_[0];
+    shared->set_sample_threshold(sample_threshold);
+    int_least64_t threshold = knobs_.distance_threshold;
+    auto replay = [&](int_least64_t index, const log_reader_t &chunk) {
+        interference_t &thread = threads[index];
+        for (size_t i = chunk.begin(); i < chunk.end(); ++i) {
+            uint8_t flags = chunk.flags[i];
+            int_least64_t dist = process_line(shared.get(), chunk.tags[i], 0,
+                                              static_cast<access_kind_t>(flags & 3));
+            if (dist == -2)
+                continue;
+            uint64_t weight = shared->sample_weight;
+            bool shared_near = dist >= 0 && dist < threshold;
+            if ((flags & shared_log_t::PRIVATE_REUSE) != 0)
+                thread.reuses += weight;
+            if ((flags & shared_log_t::PRIVATE_NEAR) != 0) {
+                thread.private_near += weight;
+                if (!shared_near)
+                    thread.lost += weight;
+            } else if (shared_near)
+                thread.shared_near += weight;
+        }
+    };
+    if (!replay_logs(false, replay)) {
+        std::cerr << "No shared-cache results\n";
+        return;
+    }
+    // Sampling left the unsampled references out of the log.
+    shared->total_refs = total_refs;
+
+    std::cerr << "\n==================================================\n"
+              << "Reuse distance tool results for a cache shared by all shards"
+              << " (interleaved by " << (serial_ ? "trace order" : "timestamp") << "):\n";
+    print_shard_results(shared.get());
+    std::cerr << "\nInterference in the shared cache, at the " << threshold
+              << "-line threshold:\n";
+    std::cerr << std::setw(8) << "shard" << std::setw(10) << "thread" << std::setw(14)
+              << "reuses" << std::setw(14) << "near alone" << std::setw(14)
+              << "lost shared" << std::setw(9) << "lost %" << std::setw(14)
+              << "gained shared"
+              << "\n";
+    for (const auto &it : threads) {
+        const interference_t &thread = it.second;
+        std::cerr << std::setw(8) << it.first << std::setw(10) << thread.tid
+                  << std::setw(14) << thread.reuses << std::setw(14) << thread.private_near
+                  << std::setw(14) << thread.lost << std::setw(8)
+                  << (thread.private_near == 0 ? 0.
+                                               : thread.lost * 100. / thread.private_near)
+                  << "%" << std::setw(14) << thread.shared_near << "\n";
+    }
+}
+
+// The part of a line in [lo, hi) as a mask with one bit per 1 << grain_bits
+// bytes.
+static inline uint64_t
+line_byte_mask(addr_t lo, addr_t hi, int grain_bits)
+{
+    addr_t first = lo >> grain_bits;
+    addr_t bits = ((hi - 1) >> grain_bits) - first + 1;
+    return (bits >= 64 ? ~0ULL : (1ULL << bits) - 1) << first;
+}
+
+// Lines over 64 bytes get one mask bit per 64th of the line.
+static inline int
+line_grain_bits(int line_bits)
+{
+    return line_bits > 6 ? line_bits - 6 : 0;
+}
+
+// Calls visit(line, mask) for each line of 1 << line_bits bytes that the
+// access touches and sampling keeps, with the bytes it touches there.
+template <typename visit_t>
+static inline void
+for_each_line(addr_t addr, size_t size, int line_bits, uint64_t sample_threshold,
+              visit_t visit)
+{
+    addr_t end = addr + std::max<size_t>(size, 1);
+    for (addr_t line = addr >> line_bits; line <= (end - 1) >> line_bits; ++line) {
+        if (hash_tag(line) >= sample_threshold)
+            continue;
+        addr_t base = line << line_bits;
+        addr_t limit = base + (static_cast<addr_t>(1) << line_bits);
+        visit(line,
+              line_byte_mask(std::max(addr, base) - base, std::min(end, limit) - base,
+                             line_grain_bits(line_bits)));
+    }
+}
+
+// The bytes a line_byte_mask covers, as "0-7,16-23".
+static std::string
+format_byte_mask(uint64_t mask, int grain_bits)
+{
+    std::ostringstream ranges;
+    for (int bit = 0; bit < 64;) {
+        if ((mask & (1ULL << bit)) == 0) {
+            ++bit;
+            continue;
+        }
+        int end = bit;
+        while (end < 64 && (mask & (1ULL << end)) != 0)
+            ++end;
+        ranges << (ranges.tellp() > 0 ? "," : "") << (bit << grain_bits) << "-"
+               << (end << grain_bits) - 1;
+        bit = end;
+    }
+    return ranges.tellp() > 0 ? ranges.str() : "-";
+}
+
+void
+reuse_distance_t::print_sharing_results()
+{
+    const int line_bits = static_cast<int>(line_size_bits_);
+    const int grain_bits = line_grain_bits(line_bits);
+    const uint64_t sample_threshold = sampling_ ? sample_threshold_ : SAMPLE_MODULUS;
+    const uint64_t weight = sampling_
+        ? std::max<int_least64_t>(1,
+                                  llround(static_cast<double>(SAMPLE_MODULUS) /
+                                          std::max<uint64_t>(sample_threshold_, 1)))
+        : 1;
+    // First, which shards touch and write each line.  The map numbers the
+    // shards by their order in shard_map_.
+    std::map<int_least64_t, uint32_t> ordinal_of;
+    for (const auto &shard : shard_map_)
+        ordinal_of.emplace(shard.first, static_cast<uint32_t>(ordinal_of.size()));
+    line_users_map_t users;
+    auto count_users = [&](int_least64_t index, const log_reader_t &chunk) {
+        uint32_t shard = ordinal_of[index];
+        for (size_t i = chunk.begin(); i < chunk.end(); ++i) {
+            bool write = chunk.flags[i] == ACCESS_WRITE;
+            for_each_line(chunk.tags[i], chunk.sizes[i], line_bits, sample_threshold,
+                          [&](addr_t line, uint64_t) { users.add(line, shard, write); });
+        }
+    };
+    if (!replay_logs(true, count_users)) {
+        std::cerr << "No sharing results\n";
+        return;
+    }
+
+    // Then replay the lines that more than one shard touches and some shard
+    // writes through an invalidation protocol: a write leaves the writer the
+    // line's only holder, and every other holder that touched a byte the
+    // write does counts a true sharing invalidation, else a false sharing one.
+    struct holder_t {
+        int_least64_t shard;
+        uint64_t bytes; // touched since the holder got the line
+    };
+    struct line_share_t {
+        addr_t line;
+        int shards;
+        uint64_t true_invalidations = 0;
+        uint64_t false_invalidations = 0;
+        std::vector<holder_t> holders;
+    };
+    uint64_t touched_shared = 0, write_shared = 0, multi_writer = 0;
+    std::unordered_map<addr_t, line_share_t> lines;
+    users.for_each([&](addr_t tag, int shards, int writers) {
+        if (shards < 2)
+            return;
+        ++touched_shared;
+        if (writers == 0)
+            return;
+        ++write_shared;
+        if (writers > 1)
+            ++multi_writer;
+        line_share_t &line = lines[tag];
+        line.line = tag;
+        line.shards = shards;
+    });
+    users = line_users_map_t();
+    uint64_t true_total = 0, false_total = 0;
+    auto invalidate = [&](int_least64_t index, const log_reader_t &chunk) {
+        for (size_t i = chunk.begin(); i < chunk.end(); ++i) {
+            bool write = chunk.flags[i] == ACCESS_WRITE;
+            for_each_line(chunk.tags[i], chunk.sizes[i], line_bits, sample_threshold,
+                          [&](addr_t tag, uint64_t mask) {
+                              auto found = lines.find(tag);
+                              if (found == lines.end())
+                                  return;
+                              line_share_t &line = found->second;
+                              holder_t *mine = NULL;
+                              for (holder_t &holder : line.holders) {
+                                  if (holder.shard == index)
+                                      mine = &holder;
+                              }
+                              if (write && line.holders.size() > (mine == NULL ? 0 : 1)) {
+                                  for (const holder_t &holder : line.holders) {
+                                      if (holder.shard == index)
+                                          continue;
+                                      if ((holder.bytes & mask) != 0)
+                                          line.true_invalidations += weight;
+                                      else
+                                          line.false_invalidations += weight;
+                                  }
+                                  line.holders.assign(
+                                      1, { index, mask | (mine == NULL ? 0 : mine->bytes) });
+                              } else if (mine != NULL)
+                                  mine->bytes |= mask;
+                              else
+                                  line.holders.push_back({ index, mask });
+                          });
+        }
+    };
+    if (!replay_logs(true, invalidate)) {
+        std::cerr << "No sharing results\n";
+        return;
+    }
+    std::vector<const line_share_t *> ranked;
+    for (const auto &it : lines) {
+        true_total += it.second.true_invalidations;
+        false_total += it.second.false_invalidations;
+        if (it.second.true_invalidations + it.second.false_invalidations > 0)
+            ranked.push_back(&it.second);
+    }
+    size_t shown = std::min<size_t>(knobs_.report_top, ranked.size());
+    std::partial_sort(ranked.begin(), ranked.begin() + shown, ranked.end(),
+                      [](const line_share_t *l, const line_share_t *r) {
+                          uint64_t l_total = l->true_invalidations + l->false_invalidations;
+                          uint64_t r_total = r->true_invalidations + r->false_invalidations;
+                          if (l_total != r_total)
+                              return l_total > r_total;
+                          return l->line < r->line;
+                      });
+    ranked.resize(shown);
+
+    // Last, the bytes each shard reads and writes in the lines shown.
+    struct shard_bytes_t {
+        uint64_t reads = 0;
+        uint64_t writes = 0;
+        uint64_t read_bytes = 0;
+        uint64_t write_bytes = 0;
+    };
+    std::unordered_map<addr_t, std::map<int_least64_t, shard_bytes_t>> detail;
+    for (const line_share_t *line : ranked)
+        detail[line->line];
+    auto count_bytes = [&](int_least64_t index, const log_reader_t &chunk) {
+        for (size_t i = chunk.begin(); i < chunk.end(); ++i) {
+            bool write = chunk.flags[i] == ACCESS_WRITE;
+            for_each_line(chunk.tags[i], chunk.sizes[i], line_bits, sample_threshold,
+                          [&](addr_t tag, uint64_t mask) {
+                              auto found = detail.find(tag);
+                              if (found == detail.end())
+                                  return;
+                              shard_bytes_t &bytes = found->second[index];
+                              if (write) {
+                                  bytes.writes += weight;
+                                  bytes.write_bytes |= mask;
+                              } else {
+                                  bytes.reads += weight;
+                                  bytes.read_bytes |= mask;
+                              }
+                          });
+        }
+    };
+    if (!replay_logs(true, count_bytes)) {
+        std::cerr << "No sharing results\n";
+        return;
+    }
+
+    std::cerr << "\n==================================================\n"
+              << "Sharing between shards, per " << knobs_.line_size << "-byte line"
+              << " (interleaved by " << (serial_ ? "trace order" : "timestamp") << "):\n";
+    if (sampling_)
+        std::cerr << "(Sampled cache lines only; counts are scaled by " << weight
+                  << ".)\n";
+    std::cerr << std::setw(50) << std::left
+              << "Lines touched by more than one shard:" << std::right << std::setw(12)
+              << touched_shared * weight << "\n";
+    std::cerr << std::setw(50) << std::left
+              << "Lines written by one and touched by another:" << std::right
+              << std::setw(12) << write_shared * weight << "\n";
+    std::cerr << std::setw(50) << std::left << "Lines written by more than one shard:"
+              << std::right << std::setw(12) << multi_writer * weight << "\n";
+    std::cerr << std::setw(50) << std::left << "Cross-shard invalidations:" << std::right
+              << std::setw(12) << true_total + false_total << "\n";
+    std::cerr << std::setw(50) << std::left << "  of the bytes the other shard touched:"
+              << std::right << std::setw(12) << true_total << "\n";
+    std::cerr << std::setw(50) << std::left << "  of other bytes (false sharing):"
+              << std::right << std::setw(12) << false_total << "\n";
+    std::cerr << "Top " << shown << " lines by cross-shard invalidations\n";
+    std::cerr << std::setw(18) << "cache line" << std::setw(8) << "shards" << std::setw(15)
+              << "invalidations" << std::setw(12) << "true" << std::setw(12) << "false"
+              << "  kind\n";
+    for (const line_share_t *line : ranked) {
+        std::cerr << std::setw(18) << std::hex << std::showbase
+                  << (line->line << line_size_bits_) << std::dec << std::setw(8)
+                  << line->shards << std::setw(15)
+                  << line->true_invalidations + line->false_invalidations << std::setw(12)
+                  << line->true_invalidations << std::setw(12)
+                  << line->false_invalidations << "  "
+                  << (line->false_invalidations > line->true_invalidations
+                          ? "false sharing"
+                          : "true sharing")
+                  << "\n";
+        for (const auto &it : detail[line->line]) {
+            const shard_bytes_t &bytes = it.second;
+            std::cerr << std::setw(26) << "shard " << it.first << " (thread "
+                      << shard_map_.at(it.first)->tid << "): " << bytes.reads
+                      << " reads of bytes " << format_byte_mask(bytes.read_bytes, grain_bits)
+                      << ", " << bytes.writes << " writes of bytes "
+                      << format_byte_mask(bytes.write_bytes, grain_bits) << "\n";
+        }
+    }
+}
+
+uint64_t
+reuse_distance_t::elapsed_usec() const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - start_time_)
+        .count();
+}
+
+static double
+peak_rss_mb()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return usage.ru_maxrss / 1024.0; // Linux reports KB
+}
+
+void
+reuse_distance_t::emit_stats(shard_data_t *shard, bool force)
+{
+    uint64_t now = elapsed_usec();
+    if (!force && now - shard->stats_usec < stats_usec_)
+        return;
+    double seconds = (now - shard->stats_usec) / 1e6;
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(3) << "stats shard " << shard->index
+         << " time " << now / 1e6 << " records " << shard->records << " records/sec "
+         << std::setprecision(0)
+         << (seconds > 0 ? (shard->records - shard->stats_records) / seconds : 0.0);
+    // The lines and hash table load of each granularity, and the bytes of
+    // every table the shard grows.
+    size_t bytes = 0;
+    line << " lines";
+    for (size_t i = 0; i < shard->grains(); ++i) {
+        line << (i == 0 ? " " : ",") << shard->grain(i)->cache_map.size();
+        bytes += shard->grain(i)->table_bytes();
+    }
+    line << " load" << std::setprecision(2);
+    for (size_t i = 0; i < shard->grains(); ++i) {
+        const line_map_t &map = shard->grain(i)->cache_map;
+        line << (i == 0 ? " " : ",") << static_cast<double>(map.size()) / map.slots();
+    }
+    if (shard->shared_log)
+        bytes += shard->shared_log->bytes();
+    if (shard->sharing_log)
+        bytes += shard->sharing_log->bytes();
+    line << std::setprecision(1) << " table_mb " << bytes / 1048576.0 << " peak_rss_mb "
+         << peak_rss_mb() << "\n";
+    shard->stats_usec = now;
+    shard->stats_records = shard->records;
+    std::lock_guard<std::mutex> guard(stats_mutex_);
+    fputs(line.str().c_str(), stats_file_);
+    fflush(stats_file_);
+}
+
+bool
+reuse_distance_t::print_results()
+{
+    uint64_t print_start = elapsed_usec();
+    if (stats_usec_ > 0) {
+        for (const auto &shard : shard_map_)
+            emit_stats(shard.second, true);
+    }
+    // Close out each shard's final partial interval.
+    if (interval_file_ != NULL) {
+        for (const auto &shard : shard_map_) {
+            if (shard.second->cur_ref > shard.second->interval_start_ref)
+                emit_interval(shard.second);
+        }
+        fflush(interval_file_);
+    }
+
+    // First, aggregate the per-shard data into whole-trace data, one
+    // granularity at a time.
+    auto aggregate = std::unique_ptr<shard_data_t>(create_shard());
+    for (size_t i = 0; i < aggregate->grains(); ++i) {
+        shard_data_t *total = aggregate->grain(i);
+        // With sampling, only lines every shard could have sampled are comparable.
+        for (const auto &shard : shard_map_) {
+            shard_data_t *grain = shard.second->grain(i);
+            if (grain->sample_threshold < total->sample_threshold)
+                total->set_sample_threshold(grain->sample_threshold);
+            // Sampling may have dropped a line from the tables.
+            for (int table = 0; table < 2; ++table) {
+                if (!grain->top[table].exact())
+                    grain->top[table].rebuild(grain->cache_map);
+            }
+            if (footprint_ && grain->line_bits >= static_cast<int>(line_size_bits_))
+                compute_footprint_misses(grain);
+        }
+        for (const auto &shard : shard_map_)
+            merge_shard(total, shard.second->grain(i));
+        merge_top_lines(total, i);
+    }
+
+    using keyval_t = std::pair<memref_tid_t, shard_data_t *>;
+    std::vector<keyval_t> sorted(shard_map_.begin(), shard_map_.end());
+    // Break ties on the shard index so the order does not depend on the
+    // scheduling that filled shard_map_.
+    std::sort(sorted.begin(), sorted.end(), [](const keyval_t &l, const keyval_t &r) {
+        if (l.second->total_refs != r.second->total_refs)
+            return l.second->total_refs > r.second->total_refs;
+        return l.first < r.first;
+    });
+    bool show_grain = aggregate->grains() > 1 || aggregate->line_bits != 0;
+    for (size_t i = 0; i < aggregate->grains(); ++i) {
+        if (show_grain) {
+            std::cerr << (i == 0 ? "" : "\n") << "##### Granularity: "
+                      << (static_cast<uint64_t>(1) << aggregate->grain(i)->line_bits)
+                      << " bytes #####\n";
+        }
+        //std::cerr << TOOL_NAME << " aggregated results:\n";
+        std::cerr << "Reuse distance tool aggregated results:\n";
+        print_shard_results(aggregate->grain(i));
+
+        if (shard_map_.size() > 1) {
+            for (const auto &shard : sorted) {
+                std::cerr << "\n==================================================\n"
+                          << "Reuse distance tool results for shard " << shard.first
+                          << " (thread " << shard.second->tid << "):\n";
+                print_shard_results(shard.second->grain(i));
+            }
+        }
+    }
+
+    if (shared_)
+        print_shared_results();
+    if (sharing_)
+        print_sharing_results();
+
+    // Reset the i/o format for subsequent tool invocations.
+    std::cerr << std::dec;
+    bool ok = result_path_.empty() || write_result_file(aggregate.get());
+    if (stats_usec_ > 0) {
+        std::lock_guard<std::mutex> guard(stats_mutex_);
+        fprintf(stats_file_, "stats print_results seconds %.3f peak_rss_mb %.1f\n",
+                (elapsed_usec() - print_start) / 1e6, peak_rss_mb());
+        fflush(stats_file_);
+    }
+    return ok;
+}
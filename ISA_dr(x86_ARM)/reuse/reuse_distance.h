@@ -0,0 +1,2417 @@
+/* **********************************************************
+ * Copyright (c) 2016-2020 Google, Inc.  All rights reserved.
+ * **********************************************************/
+
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Google, Inc. nor the names of its contributors may be
+ *   used to endorse or promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL VMWARE, INC. OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* reuse-distance: a memory trace reuse distance analysis tool.
+ *
+ * This header replaces clients/drcachesim/tools/reuse_distance.h in the
+ * DynamoRIO tree together with reuse_distance.cpp.  One build serves every
+ * stream mode: reuse_distance_tool_create instantiates reuse_stream_tool_t
+ * for the data accesses, the instruction fetches, or both (WPC_REUSE_STREAM).
+ */
+
+#ifndef _REUSE_DISTANCE_H_
+#define _REUSE_DISTANCE_H_ 1
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "analysis_tool.h"
+#include "memref.h"
+#include "reuse_distance_create.h"
+#include "reuse_result.h"
+
+// We see noticeable overhead in release build with an if() that directly
+// checks knob_verbose, so for debug-only uses we turn it into something the
+// compiler can remove for better performance without going so far as ifdef-ing
+// big code chunks and impairing readability.
+#ifdef DEBUG
+#    define DEBUG_VERBOSE(level) (reuse_distance_t::knob_verbose >= (level))
+#else
+#    define DEBUG_VERBOSE(level) (false)
+#endif
+
+// Each shard tracks this many times the reported number of top lines, so the
+// aggregate's tables, merged from the shards' tables, seldom miss a line.
+static const size_t TOP_LINES_TRACKED = 4;
+
+// A shard with telemetry on reads the clock once per this many records.
+static const uint64_t STATS_CHECK_RECORDS = 1 << 14;
+
+// What an access does to its line.
+enum access_kind_t {
+    ACCESS_READ,
+    ACCESS_WRITE,
+    ACCESS_PREFETCH,
+};
+
+// What computes the reuse distances (WPC_REUSE_ENGINE).
+enum reuse_engine_t {
+    ENGINE_TREE, // line_ref_tree_t
+    ENGINE_LIST, // line_ref_list_t
+    ENGINE_NONE, // none: reuse times only, for the footprint
+};
+
+// Reuses split by the kinds of the previous and the current access.
+enum reuse_kind_t {
+    REUSE_RAR,
+    REUSE_RAW,
+    REUSE_WAR,
+    REUSE_WAW,
+    REUSE_PREFETCH_HIT, // a demand access to a line last prefetched
+    REUSE_PREFETCH,     // a prefetch of a line already touched
+    REUSE_KINDS,
+};
+
+// SHARDS spatial sampling keeps a tag when its hash modulo SAMPLE_MODULUS
+// falls below a shard's sample threshold.
+static const uint64_t SAMPLE_MODULUS = 1 << 24;
+
+// What the shared code needs to know of a stream policy; the policies below
+// fix it at compile time and reuse_stream_tool_t selects records with them.
+struct reuse_stream_traits_t {
+    const char *name;
+    bool data;  // reads, writes and prefetches, with their access kinds
+    bool instr; // instruction fetches, tagged by pc
+    // The power-of-two rows of the printed reuse time table.
+    int time_rows;
+    const char *count_label;
+};
+
+struct data_stream_t {
+    static const bool DATA = true;
+    static const bool INSTR = false;
+    static reuse_stream_traits_t
+    traits()
+    {
+        return { "data", DATA, INSTR, 36, "inst count" };
+    }
+};
+
+struct instr_stream_t {
+    static const bool DATA = false;
+    static const bool INSTR = true;
+    static reuse_stream_traits_t
+    traits()
+    {
+        return { "instr", DATA, INSTR, 40, "reuse inst count" };
+    }
+};
+
+// Fetches and data accesses in one stack, as a unified cache sees them.
+struct combined_stream_t {
+    static const bool DATA = true;
+    static const bool INSTR = true;
+    static reuse_stream_traits_t
+    traits()
+    {
+        return { "combined", DATA, INSTR, 40, "inst count" };
+    }
+};
+
+// One line of the trace's module list: [start, end) maps to offset in path.
+struct module_range_t {
+    addr_t start;
+    addr_t end;
+    uint64_t offset;
+    std::string path;
+};
+
+/* Everything but the choice of records: reuse_stream_tool_t supplies
+ * process_memref and parallel_shard_memref for one stream policy.
+ */
+class reuse_distance_t : public analysis_tool_t {
+public:
+    ~reuse_distance_t() override;
+    bool
+    print_results() override;
+    bool
+    parallel_shard_supported() override;
+    void *
+    parallel_shard_init(int shard_index, void *worker_data) override;
+    bool
+    parallel_shard_exit(void *shard_data) override;
+    std::string
+    parallel_shard_error(void *shard_data) override;
+
+    // Global value for use in non-member code.
+    static unsigned int knob_verbose;
+
+protected:
+    reuse_distance_t(const reuse_distance_knobs_t &knobs,
+                     const reuse_stream_traits_t &stream);
+
+    // Defined below, once the line structures it holds are complete.
+    struct shard_data_t;
+
+    // For serial operation, the shard of the record's thread, cut for a new
+    // chunk whenever the thread changes.
+    shard_data_t *
+    serial_shard(const memref_t &memref);
+    // Does the bookkeeping every record gets (skipping what a checkpoint
+    // covers, checkpoints, telemetry) and handles thread exits and markers.
+    // Returns whether the record is left for the stream to select.
+    bool
+    start_record(shard_data_t *shard, const memref_t &memref);
+    // Accounts a read, write or prefetch, logging it for sharing mode.
+    void
+    process_data_access(shard_data_t *shard, const memref_t &memref);
+    // Accounts one selected access to every granularity and the set model.
+    void
+    account_access(shard_data_t *shard, addr_t addr, size_t size, addr_t pc,
+                   access_kind_t kind);
+
+    shard_data_t *
+    create_shard();
+    // A new shard with the given index, restored from its checkpoint when
+    // resuming.
+    shard_data_t *
+    create_indexed_shard(int_least64_t index);
+    // Queues the shard's changes since its last checkpoint for appending to
+    // its checkpoint file, or its whole state for rewriting the file once the
+    // changes outgrow the state or the last write failed.
+    void
+    save_checkpoint(shard_data_t *shard);
+    // The checkpoint writer thread's loop: writes queued segments until
+    // checkpoint_stop_ is set and the queue is empty.
+    void
+    write_checkpoints();
+    bool
+    load_checkpoint(shard_data_t *shard);
+    // Accounts one access of size bytes at addr to one granularity.
+    void
+    process_access(shard_data_t *shard, addr_t addr, size_t size, addr_t pc,
+                   access_kind_t kind);
+    // Returns the reuse distance, -1 for a first touch (or any access with no
+    // engine) or -2 for a tag left out by sampling.
+    int_least64_t
+    process_line(shard_data_t *shard, addr_t tag, addr_t pc, access_kind_t kind);
+    // Folds one granularity of a shard into the same granularity of the
+    // aggregate.
+    void
+    merge_shard(shard_data_t *aggregate, const shard_data_t *shard);
+    // Ranks the lines in any shard's tables of one granularity by their
+    // whole-trace counts, for the aggregate's tables.
+    void
+    merge_top_lines(shard_data_t *aggregate, size_t grain);
+    void
+    print_shard_results(const shard_data_t *shard);
+    // Fills in the shard's footprint_misses from its reuse times and its
+    // lines' first and last access times.
+    void
+    compute_footprint_misses(shard_data_t *shard);
+    void
+    print_miss_ratio_curve(const shard_data_t *shard);
+    void
+    print_kind_results(const shard_data_t *shard);
+    void
+    print_set_results(const shard_data_t *shard);
+    void
+    print_pc_results(const shard_data_t *shard);
+    // Calls visit(shard index, reader) for every non-empty chunk of the
+    // shards' shared-cache logs, or with sharing set their sharing logs, in
+    // replay order, merging the logs' files a block at a time.  Returns false
+    // if a log could not be written or read back.
+    template <typename visit_t>
+    bool
+    replay_logs(bool sharing, visit_t visit);
+    // Replays every shard's logged accesses as one interleaved stream.
+    void
+    print_shared_results();
+    // Replays every shard's logged data accesses to find the lines that
+    // bounce between shards.
+    void
+    print_sharing_results();
+    // "module+0xoffset" for a pc inside a listed module, else just the pc.
+    std::string
+    symbolize(addr_t pc) const;
+    // Streams the shard's histograms since its previous interval record.
+    void
+    emit_interval(shard_data_t *shard);
+    // Writes the shard's telemetry line if a period has passed since its
+    // last one, or regardless with force.
+    void
+    emit_stats(shard_data_t *shard, bool force);
+    uint64_t
+    elapsed_usec() const;
+    void
+    fill_result_record(const shard_data_t *shard, int_least64_t index,
+                       const reuse_result_header_t *header,
+                       reuse_result_record_t *record);
+    bool
+    write_result_file(const shard_data_t *aggregate);
+
+    const reuse_distance_knobs_t knobs_;
+    const size_t line_size_bits_;
+    // The records analyzed (WPC_REUSE_STREAM).
+    const reuse_stream_traits_t stream_;
+    // WPC_REUSE_ENGINE: "tree", "list", or "hotl" for no engine.
+    const reuse_engine_t engine_;
+    // Adds the miss ratio curve from the footprint (WPC_FOOTPRINT, on by
+    // default with no engine).
+    const bool footprint_;
+    // SHARDS sampling (WPC_SHARDS_RATE, WPC_SHARDS_MAX): the initial threshold
+    // out of SAMPLE_MODULUS and the fixed sample size, 0 for a fixed rate.
+    uint64_t sample_threshold_;
+    uint64_t sample_max_;
+    bool sampling_;
+    // The associativity for the set-associative miss ratio column, 0 for
+    // none (WPC_MRC_ASSOC).
+    int mrc_assoc_;
+    // Sub-buckets per octave of the histograms, as a power of two
+    // (WPC_HIST_SUB_BITS).
+    int hist_bits_;
+    // The tag granularities analyzed together, as address shifts
+    // (WPC_LINE_SHIFTS); a shift of 0 keeps whole addresses.
+    std::vector<int> line_shifts_;
+    // Interval snapshots (WPC_INTERVAL_REFS, WPC_INTERVAL_USEC): a record is
+    // written every so many of a shard's references or timestamp microseconds,
+    // 0 for never.  Shards share the file, so writes hold interval_mutex_.
+    uint64_t interval_refs_;
+    uint64_t interval_usec_;
+    FILE *interval_file_;
+    std::mutex interval_mutex_;
+    // Telemetry (WPC_STATS_MSEC, WPC_STATS_FILE): every so many milliseconds
+    // of the run each shard writes a line with its throughput, table sizes and
+    // the peak RSS, 0 for never, and print_results adds how long it took.
+    // Lines go to stderr unless a file is named; writes hold stats_mutex_.
+    uint64_t stats_usec_;
+    FILE *stats_file_;
+    std::mutex stats_mutex_;
+    const std::chrono::steady_clock::time_point start_time_;
+    // Where print_results also writes the binary results (WPC_RESULT_FILE).
+    std::string result_path_;
+    // Entries per pc_summary_t, 0 to skip the per-pc attribution
+    // (WPC_PC_ENTRIES).
+    size_t pc_entries_;
+    // The trace's module list (WPC_MODULE_FILE), sorted by start, to name pcs.
+    std::vector<module_range_t> modules_;
+    // The set-associative model's geometry (WPC_SET_CACHE, "<size>:<ways>"),
+    // 0 sets for none.
+    uint64_t set_sets_;
+    int set_ways_;
+    // Checkpoints (WPC_CHECKPOINT_REFS, WPC_CHECKPOINT_FILE, WPC_RESUME): each
+    // shard saves its state to <path>.<shard index> every so many of its
+    // records, 0 for never, and a resumed run restores it and skips the
+    // records it covers.
+    uint64_t checkpoint_records_;
+    std::string checkpoint_path_;
+    bool resume_;
+    // A shard builds its segment on its own thread and the writer thread puts
+    // it in the file, so records never wait on the file system.  A shard has
+    // at most one segment queued; the queue, the shards' checkpoint_pending
+    // and checkpoint_failed and checkpoint_stop_ are guarded by
+    // checkpoint_mutex_.
+    struct checkpoint_job_t {
+        shard_data_t *shard;
+        bool whole;
+        uint64_t records;
+        std::string path;
+        std::vector<char> data;
+    };
+    std::thread checkpoint_thread_;
+    std::mutex checkpoint_mutex_;
+    std::condition_variable checkpoint_cond_;
+    std::deque<checkpoint_job_t> checkpoint_jobs_;
+    bool checkpoint_stop_ = false;
+    // Shared-cache mode (WPC_SHARED): shards log their accesses, cut into
+    // chunks at timestamps, and print_results replays the chunks of all
+    // shards in order.  Serial runs see the real interleaving, so there a
+    // chunk is cut whenever the shard changes, keyed by serial_chunks_.
+    bool shared_;
+    // Sharing mode (WPC_SHARING): shards log their reads and writes the same
+    // way, and print_results replays them per -line_size line to count the
+    // invalidations each line would see in coherent private caches.
+    bool sharing_;
+    // The logs' files are <path>.<shard index>.shared and .sharing
+    // (WPC_LOG_FILE).
+    std::string log_path_;
+    bool serial_ = false;
+    shard_data_t *serial_shard_ = NULL;
+    uint64_t serial_chunks_ = 0;
+    static const std::string TOOL_NAME;
+    // In parallel operation the keys are "shard indices": just ints.
+    std::unordered_map<memref_tid_t, shard_data_t *> shard_map_;
+    // This mutex is only needed in parallel_shard_init.  In all other accesses to
+    // shard_map (process_memref, print_results) we are single-threaded.
+    std::mutex shard_map_mutex_;
+};
+
+/* The cache line reference info.  The list engine extends it with its links
+ * (line_list_ref_t), so the other engines' records do not carry them.
+ */
+struct line_ref_t {
+    // The most recent reference time stamp on this line.  For line_ref_tree_t
+    // this is the line's slot in the tree.
+    uint64_t time_stamp;
+    uint64_t total_refs;   // the total number of references on this line
+    uint64_t distant_refs; // the total number of distant references on this line
+    uint64_t last_ref : 61; // the shard's reference count at the latest access
+    uint64_t last_kind : 2; // the access_kind_t of the latest access
+    uint64_t dirty : 1;     // touched since the shard's last checkpoint
+    addr_t tag;
+    // The line's place in each line_top_t heap, or -1 when it is not there.
+    int32_t top_pos[2];
+
+    line_ref_t(addr_t val)
+        : time_stamp(0)
+        , total_refs(1)
+        , distant_refs(0)
+        , last_ref(0)
+        , last_kind(0)
+        , dirty(0)
+        , tag(val)
+        , top_pos { -1, -1 }
+    {
+    }
+};
+
+/* A doubly linked list node for the cache line reference info */
+struct line_list_ref_t : line_ref_t {
+    line_list_ref_t *prev; // the prev line_ref in the list
+    line_list_ref_t *next; // the next line_ref in the list
+    // We have a one-layer skip list for more efficient depth computation.
+    // We insert every Nth element in this list.
+    line_list_ref_t *prev_skip; // the prev line_ref in the skip list
+    line_list_ref_t *next_skip; // the next line_ref in the skip list
+    // Depth is only valid if this line is in the skip list.
+    uint64_t depth;
+
+    line_list_ref_t(addr_t val)
+        : line_ref_t(val)
+        , prev(NULL)
+        , next(NULL)
+        , prev_skip(NULL)
+        , next_skip(NULL)
+        , depth(-1)
+    {
+    }
+};
+
+static_assert(sizeof(line_ref_t) == 48, "line_ref_t layout");
+
+/* A doubly linked list storing the cache line reference info.
+ * The head of the list is the most recent reference.
+ * The list is ordered by the time stamp of the line's most recent reference.
+ * A one-level skip list of every skip_distance_-th node, each of which knows
+ * its own depth, bounds the walk needed to compute a distance.
+ */
+struct line_ref_list_t {
+    line_list_ref_t *head_;       // the most recently referenced cache line
+    line_list_ref_t *tail_;       // the least recently referenced cache line
+    line_list_ref_t *skip_head_;  // the skip list node closest to head_
+    line_list_ref_t *skip_tail_;  // the skip list node closest to tail_
+    uint64_t cur_time_;      // the global time stamp
+    uint64_t unique_lines_;  // the total number of unique cache lines accessed
+    uint64_t threshold_;     // the reuse distance threshold
+    uint64_t skip_distance_; // distance between skip list nodes
+    bool verify_skip_;       // check results using brute-force walks
+
+    line_ref_list_t(uint64_t reuse_threshold, uint64_t skip_dist, bool verify)
+        : head_(NULL)
+        , tail_(NULL)
+        , skip_head_(NULL)
+        , skip_tail_(NULL)
+        , cur_time_(0)
+        , unique_lines_(0)
+        , threshold_(reuse_threshold)
+        , skip_distance_(skip_dist == 0 ? 1 : skip_dist)
+        , verify_skip_(verify)
+    {
+    }
+
+    // The line_ref_t's belong to the shard's line_pool_t.
+    virtual ~line_ref_list_t()
+    {
+    }
+
+    bool
+    only_one()
+    {
+        return (head_ != NULL && head_ == tail_);
+    }
+
+    // Hand ref's skip list slot to ref->prev, which is about to take over
+    // ref's depth.
+    void
+    shift_skip_to_prev(line_list_ref_t *ref)
+    {
+        line_list_ref_t *to = ref->prev;
+        assert(to != NULL && to->depth == (uint64_t)-1);
+        to->depth = ref->depth;
+        to->prev_skip = ref->prev_skip;
+        to->next_skip = ref->next_skip;
+        if (to->prev_skip != NULL)
+            to->prev_skip->next_skip = to;
+        else
+            skip_head_ = to;
+        if (to->next_skip != NULL)
+            to->next_skip->prev_skip = to;
+        else
+            skip_tail_ = to;
+        ref->depth = -1;
+        ref->prev_skip = NULL;
+        ref->next_skip = NULL;
+    }
+
+    // Add a new cache line to the front of the list.
+    // Every node moves one deeper, so each skip node hands its slot to its
+    // predecessor, and the new tail joins the skip list when it lands on a
+    // multiple of skip_distance_.
+    void
+    add_to_front(line_ref_t *line)
+    {
+        line_list_ref_t *ref = static_cast<line_list_ref_t *>(line);
+        if (DEBUG_VERBOSE(3))
+            std::cerr << "Add tag 0x" << std::hex << ref->tag << std::dec << "\n";
+        for (line_list_ref_t *skip = skip_head_; skip != NULL;) {
+            line_list_ref_t *next = skip->next_skip;
+            shift_skip_to_prev(skip);
+            skip = next;
+        }
+        // update head_
+        ref->next = head_;
+        if (head_ != NULL)
+            head_->prev = ref;
+        head_ = ref;
+        if (tail_ == NULL)
+            tail_ = ref;
+        // set ref
+        ref->time_stamp = cur_time_++;
+        ++unique_lines_;
+        uint64_t tail_depth = unique_lines_ - 1;
+        if (tail_depth > 0 && tail_depth % skip_distance_ == 0) {
+            tail_->depth = tail_depth;
+            tail_->prev_skip = skip_tail_;
+            tail_->next_skip = NULL;
+            if (skip_tail_ != NULL)
+                skip_tail_->next_skip = tail_;
+            else
+                skip_head_ = tail_;
+            skip_tail_ = tail_;
+        }
+    }
+
+    // Walk toward the head until we find a node that knows its depth.
+    int_least64_t
+    skip_depth(line_list_ref_t *ref)
+    {
+        int_least64_t dist = 0;
+        line_list_ref_t *prev = ref;
+        while (prev != head_ && prev->depth == (uint64_t)-1) {
+            prev = prev->prev;
+            ++dist;
+        }
+        if (prev->depth != (uint64_t)-1)
+            dist += prev->depth;
+        return dist;
+    }
+
+    // Brute-force depth computation used to verify the skip list.
+    int_least64_t
+    walk_depth(line_list_ref_t *ref)
+    {
+        int_least64_t dist = 0;
+        for (line_list_ref_t *prev = head_; prev != ref; prev = prev->next)
+            ++dist;
+        return dist;
+    }
+
+    // Move a referenced cache line to the front of the list.
+    // Every node between the head and ref's old position moves one deeper,
+    // so every skip node at or above that position hands its slot to its
+    // predecessor to keep the same distance from the head.
+    int_least64_t
+    move_to_front(line_ref_t *line)
+    {
+        line_list_ref_t *ref = static_cast<line_list_ref_t *>(line);
+        if (DEBUG_VERBOSE(3))
+            std::cerr << "Move tag 0x" << std::hex << ref->tag << std::dec << " to front\n";
+        ++ref->total_refs;
+        if (ref == head_)
+            return 0;
+        int_least64_t dist = skip_depth(ref);
+        if (verify_skip_) {
+            int_least64_t brute_dist = walk_depth(ref);
+            if (brute_dist != dist) {
+                std::cerr << "Skip list error: " << dist << " vs " << brute_dist
+                          << "\n";
+                assert(false);
+            }
+        }
+        if (dist >= (int_least64_t)threshold_)
+            ++ref->distant_refs;
+
+        for (line_list_ref_t *skip = skip_head_;
+             skip != NULL && skip->depth <= (uint64_t)dist;) {
+            line_list_ref_t *next = skip->next_skip;
+            shift_skip_to_prev(skip);
+            skip = next;
+        }
+        // remove ref from the list
+        ref->prev->next = ref->next;
+        if (ref->next != NULL)
+            ref->next->prev = ref->prev;
+        else
+            tail_ = ref->prev;
+        // move ref to the front
+        ref->prev = NULL;
+        ref->next = head_;
+        head_->prev = ref;
+        head_ = ref;
+        ref->time_stamp = cur_time_++;
+        return dist;
+    }
+
+    // Unlink a cache line for good; the caller recycles the record.  Every node deeper than ref moves one
+    // shallower, so every skip node at or below ref's position hands its slot
+    // to its successor, and the deepest one is dropped if it runs off the tail.
+    void
+    remove(line_ref_t *line)
+    {
+        line_list_ref_t *ref = static_cast<line_list_ref_t *>(line);
+        uint64_t depth = skip_depth(ref);
+        for (line_list_ref_t *skip = skip_tail_; skip != NULL && skip->depth >= depth;) {
+            line_list_ref_t *prev = skip->prev_skip;
+            line_list_ref_t *to = skip->next;
+            if (to != NULL) {
+                to->depth = skip->depth;
+                to->prev_skip = skip->prev_skip;
+                to->next_skip = skip->next_skip;
+                if (to->next_skip != NULL)
+                    to->next_skip->prev_skip = to;
+                else
+                    skip_tail_ = to;
+            } else {
+                skip_tail_ = prev;
+            }
+            if (prev != NULL)
+                prev->next_skip = to;
+            else
+                skip_head_ = to;
+            skip->depth = -1;
+            skip->prev_skip = NULL;
+            skip->next_skip = NULL;
+            skip = prev;
+        }
+        if (ref->prev != NULL)
+            ref->prev->next = ref->next;
+        else
+            head_ = ref->next;
+        if (ref->next != NULL)
+            ref->next->prev = ref->prev;
+        else
+            tail_ = ref->prev;
+        --unique_lines_;
+    }
+};
+
+/* An order-statistic view of the same LRU stack (Bennett-Kruskal).
+ * Each access takes the next slot in a Fenwick tree that holds a 1 for every
+ * slot that is still some line's most recent access, so the stack distance of
+ * a reuse is the number of live slots after the line's previous slot.  Slots
+ * are renumbered in place once they run out, which keeps the tree at about
+ * twice the number of unique lines and makes every reference O(log n) with
+ * no allocation.
+ */
+struct line_ref_tree_t {
+    std::vector<uint64_t> tree_; // 1-based Fenwick tree over the slots
+    std::vector<line_ref_t *> slots_; // the line whose latest access is each slot
+    uint64_t next_slot_;     // the slot for the next access
+    uint64_t cur_time_;      // the global time stamp
+    uint64_t unique_lines_;  // the total number of unique cache lines accessed
+    uint64_t threshold_;     // the reuse distance threshold
+
+    static const uint64_t MIN_SLOTS = 1 << 16;
+
+    explicit line_ref_tree_t(uint64_t reuse_threshold)
+        : tree_(MIN_SLOTS + 1, 0)
+        , slots_(MIN_SLOTS, NULL)
+        , next_slot_(0)
+        , cur_time_(0)
+        , unique_lines_(0)
+        , threshold_(reuse_threshold)
+    {
+    }
+
+    // The line_ref_t's belong to the shard's line_pool_t.
+    virtual ~line_ref_tree_t()
+    {
+    }
+
+    void
+    tree_add(uint64_t slot, int64_t delta)
+    {
+        for (uint64_t i = slot + 1; i < tree_.size(); i += i & (~i + 1))
+            tree_[i] += delta;
+    }
+
+    // The number of live slots in [0, slot].
+    uint64_t
+    tree_prefix(uint64_t slot)
+    {
+        uint64_t sum = 0;
+        for (uint64_t i = slot + 1; i > 0; i -= i & (~i + 1))
+            sum += tree_[i];
+        return sum;
+    }
+
+    // Renumber the live slots densely, preserving their order, and rebuild the
+    // tree in linear time.
+    void
+    compact()
+    {
+        uint64_t live = 0;
+        for (uint64_t i = 0; i < next_slot_; ++i) {
+            if (slots_[i] == NULL)
+                continue;
+            slots_[live] = slots_[i];
+            slots_[live]->time_stamp = live;
+            ++live;
+        }
+        uint64_t size = std::max<uint64_t>(MIN_SLOTS, 2 * live);
+        slots_.resize(size);
+        std::fill(slots_.begin() + live, slots_.end(), (line_ref_t *)NULL);
+        tree_.assign(size + 1, 0);
+        for (uint64_t i = 1; i <= size; ++i) {
+            if (i <= live)
+                ++tree_[i];
+            uint64_t parent = i + (i & (~i + 1));
+            if (parent <= size)
+                tree_[parent] += tree_[i];
+        }
+        next_slot_ = live;
+    }
+
+    void
+    take_slot(line_ref_t *ref)
+    {
+        if (next_slot_ == slots_.size())
+            compact();
+        ref->time_stamp = next_slot_;
+        slots_[next_slot_] = ref;
+        tree_add(next_slot_, 1);
+        ++next_slot_;
+    }
+
+    void
+    add_to_front(line_ref_t *ref)
+    {
+        take_slot(ref);
+        ++cur_time_;
+        ++unique_lines_;
+    }
+
+    int_least64_t
+    move_to_front(line_ref_t *ref)
+    {
+        ++ref->total_refs;
+        if (ref->time_stamp + 1 == next_slot_)
+            return 0;
+        int_least64_t dist = unique_lines_ - tree_prefix(ref->time_stamp);
+        if (dist >= (int_least64_t)threshold_)
+            ++ref->distant_refs;
+        slots_[ref->time_stamp] = NULL;
+        tree_add(ref->time_stamp, -1);
+        take_slot(ref);
+        ++cur_time_;
+        return dist;
+    }
+
+    void
+    remove(line_ref_t *ref)
+    {
+        slots_[ref->time_stamp] = NULL;
+        tree_add(ref->time_stamp, -1);
+        --unique_lines_;
+    }
+
+    size_t
+    bytes() const
+    {
+        return tree_.capacity() * sizeof(uint64_t) + slots_.capacity() * sizeof(line_ref_t *);
+    }
+};
+
+/* An open-addressing hash table from tag to line record.  Entries (an 8-byte
+ * tag and the record pointer) are stored inline and probed linearly from a
+ * Fibonacci hash of the tag, so a lookup usually touches a single cache line
+ * instead of a bucket list and a heap node.  An empty slot has a NULL record.
+ * Erasing shifts the rest of the probe run back, so there are no tombstones.
+ */
+struct line_map_t {
+    typedef std::pair<addr_t, line_ref_t *> entry_t;
+
+    // Walks the occupied slots; dereferences to an entry_t like the
+    // std::unordered_map this replaces.
+    class const_iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef entry_t value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const entry_t *pointer;
+        typedef const entry_t &reference;
+
+        const_iterator(const entry_t *pos, const entry_t *end)
+            : pos_(pos)
+            , end_(end)
+        {
+            skip_empty();
+        }
+        reference
+        operator*() const
+        {
+            return *pos_;
+        }
+        pointer
+        operator->() const
+        {
+            return pos_;
+        }
+        const_iterator &
+        operator++()
+        {
+            ++pos_;
+            skip_empty();
+            return *this;
+        }
+        const_iterator
+        operator++(int)
+        {
+            const_iterator old = *this;
+            ++*this;
+            return old;
+        }
+        bool
+        operator==(const const_iterator &other) const
+        {
+            return pos_ == other.pos_;
+        }
+        bool
+        operator!=(const const_iterator &other) const
+        {
+            return pos_ != other.pos_;
+        }
+
+    private:
+        void
+        skip_empty()
+        {
+            while (pos_ != end_ && pos_->second == NULL)
+                ++pos_;
+        }
+        const entry_t *pos_;
+        const entry_t *end_;
+    };
+
+    static const size_t MIN_BITS = 10;
+
+    line_map_t()
+        : size_(0)
+    {
+        resize(MIN_BITS);
+    }
+
+    size_t
+    size() const
+    {
+        return size_;
+    }
+
+    // The slots allocated, occupied or not.
+    size_t
+    slots() const
+    {
+        return table_.size();
+    }
+
+    size_t
+    bytes() const
+    {
+        return table_.capacity() * sizeof(entry_t);
+    }
+
+    const_iterator
+    begin() const
+    {
+        return const_iterator(table_.data(), table_.data() + table_.size());
+    }
+
+    const_iterator
+    end() const
+    {
+        return const_iterator(table_.data() + table_.size(),
+                              table_.data() + table_.size());
+    }
+
+    line_ref_t *
+    find(addr_t tag) const
+    {
+        for (size_t i = home(tag);; i = (i + 1) & mask_) {
+            const entry_t &entry = table_[i];
+            if (entry.second == NULL)
+                return NULL;
+            if (entry.first == tag)
+                return entry.second;
+        }
+    }
+
+    // The tag must not be present yet.
+    void
+    insert(addr_t tag, line_ref_t *ref)
+    {
+        // Keep the load factor at or below 3/4.
+        if ((size_ + 1) * 4 > table_.size() * 3)
+            resize(bits_ + 1);
+        place(tag, ref);
+        ++size_;
+    }
+
+    void
+    erase(addr_t tag)
+    {
+        size_t hole = home(tag);
+        while (table_[hole].first != tag || table_[hole].second == NULL) {
+            assert(table_[hole].second != NULL);
+            hole = (hole + 1) & mask_;
+        }
+        // Pull back each later entry of the run whose home is at or before the hole.
+        for (size_t i = (hole + 1) & mask_; table_[i].second != NULL;
+             i = (i + 1) & mask_) {
+            if (((i - home(table_[i].first)) & mask_) >= ((i - hole) & mask_)) {
+                table_[hole] = table_[i];
+                hole = i;
+            }
+        }
+        table_[hole] = entry_t(0, NULL);
+        --size_;
+    }
+
+    // Size the table up front for n entries.
+    void
+    reserve(size_t n)
+    {
+        size_t bits = bits_;
+        while (n * 4 > (static_cast<size_t>(1) << bits) * 3)
+            ++bits;
+        if (bits != bits_)
+            resize(bits);
+    }
+
+private:
+    size_t
+    home(addr_t tag) const
+    {
+        return static_cast<size_t>((tag * 0x9e3779b97f4a7c15ULL) >> (64 - bits_));
+    }
+
+    void
+    place(addr_t tag, line_ref_t *ref)
+    {
+        size_t i = home(tag);
+        while (table_[i].second != NULL)
+            i = (i + 1) & mask_;
+        table_[i] = entry_t(tag, ref);
+    }
+
+    void
+    resize(size_t bits)
+    {
+        std::vector<entry_t> old;
+        old.swap(table_);
+        bits_ = bits;
+        mask_ = (static_cast<size_t>(1) << bits) - 1;
+        table_.assign(mask_ + 1, entry_t(0, NULL));
+        for (const entry_t &entry : old) {
+            if (entry.second != NULL)
+                place(entry.first, entry.second);
+        }
+    }
+
+    std::vector<entry_t> table_;
+    size_t bits_;
+    size_t mask_;
+    size_t size_;
+};
+
+/* Which shards touch and write each line, for the first pass of the sharing
+ * report.  As in line_map_t the entries sit inline in an open-addressing
+ * table probed from a Fibonacci hash; an entry holds the line's first shard
+ * and its writer as ordinals into the report's shards, so a line only one
+ * shard touches costs a single 24-byte slot.  Only a line that more shards
+ * touch gets a list of the others.  Entries are never erased.
+ */
+struct line_users_map_t {
+    static const uint32_t NONE = UINT32_MAX;
+    static const uint32_t MANY = UINT32_MAX - 1; // as writer: two or more shards
+
+    line_users_map_t()
+        : size_(0)
+    {
+        resize(line_map_t::MIN_BITS);
+    }
+
+    size_t
+    size() const
+    {
+        return size_;
+    }
+
+    void
+    add(addr_t line, uint32_t shard, bool write)
+    {
+        size_t i = home(line);
+        while (table_[i].first != NONE && table_[i].line != line)
+            i = (i + 1) & mask_;
+        entry_t &entry = table_[i];
+        if (entry.first == NONE) {
+            // Keep the load factor at or below 3/4.
+            if ((size_ + 1) * 4 > table_.size() * 3) {
+                resize(bits_ + 1);
+                add(line, shard, write);
+                return;
+            }
+            entry.line = line;
+            entry.first = shard;
+            ++size_;
+        } else if (entry.first != shard) {
+            if (entry.others == 0) {
+                others_.push_back(std::vector<uint32_t>());
+                entry.others = static_cast<uint32_t>(others_.size());
+            }
+            std::vector<uint32_t> &others = others_[entry.others - 1];
+            if (std::find(others.begin(), others.end(), shard) == others.end())
+                others.push_back(shard);
+        }
+        if (!write || entry.writer == shard || entry.writer == MANY)
+            return;
+        if (entry.writer == NONE)
+            entry.writer = shard;
+        else
+            entry.writer = MANY;
+    }
+
+    // Calls visit(line, shards, writers) for every line, with writers capped
+    // at 2.
+    template <typename visit_t>
+    void
+    for_each(visit_t visit) const
+    {
+        for (const entry_t &entry : table_) {
+            if (entry.first == NONE)
+                continue;
+            int shards = 1 +
+                (entry.others == 0 ? 0 : static_cast<int>(others_[entry.others - 1].size()));
+            int writers = entry.writer == NONE ? 0 : entry.writer == MANY ? 2 : 1;
+            visit(entry.line, shards, writers);
+        }
+    }
+
+private:
+    struct entry_t {
+        addr_t line;
+        uint32_t first;  // NONE in an empty slot
+        uint32_t writer; // NONE, the only writer, or MANY
+        uint32_t others; // 1 + the index of the line's list in others_, 0 for none
+    };
+
+    size_t
+    home(addr_t line) const
+    {
+        return static_cast<size_t>((line * 0x9e3779b97f4a7c15ULL) >> (64 - bits_));
+    }
+
+    void
+    resize(size_t bits)
+    {
+        std::vector<entry_t> old;
+        old.swap(table_);
+        bits_ = bits;
+        mask_ = (static_cast<size_t>(1) << bits) - 1;
+        entry_t empty = { 0, NONE, NONE, 0 };
+        table_.assign(mask_ + 1, empty);
+        for (const entry_t &entry : old) {
+            if (entry.first == NONE)
+                continue;
+            size_t i = home(entry.line);
+            while (table_[i].first != NONE)
+                i = (i + 1) & mask_;
+            table_[i] = entry;
+        }
+    }
+
+    std::vector<entry_t> table_;
+    std::vector<std::vector<uint32_t>> others_;
+    size_t bits_;
+    size_t mask_;
+    size_t size_;
+};
+
+/* Line records are carved out of large slabs and recycled through a free list
+ * chained through the dead records' first word, so a new line rarely
+ * allocates and a shard's records are all released at once with its pool.
+ * A linked pool holds line_list_ref_t records for the list engine; the others
+ * get the smaller line_ref_t.
+ */
+struct line_pool_t {
+    static const size_t SLAB_LINES = 4096;
+
+    explicit line_pool_t(bool linked = false)
+        : linked_(linked)
+        , record_size_(linked ? sizeof(line_list_ref_t) : sizeof(line_ref_t))
+        , free_(NULL)
+        , slab_used_(SLAB_LINES)
+    {
+    }
+
+    ~line_pool_t()
+    {
+        for (char *slab : slabs_)
+            ::operator delete(slab);
+    }
+
+    line_ref_t *
+    alloc(addr_t tag)
+    {
+        void *ref;
+        if (free_ != NULL) {
+            ref = free_;
+            free_ = *static_cast<void **>(free_);
+        } else {
+            if (slab_used_ == SLAB_LINES) {
+                slabs_.push_back(
+                    static_cast<char *>(::operator new(SLAB_LINES * record_size_)));
+                slab_used_ = 0;
+            }
+            ref = slabs_.back() + slab_used_++ * record_size_;
+        }
+        if (linked_)
+            return new (ref) line_list_ref_t(tag);
+        return new (ref) line_ref_t(tag);
+    }
+
+    void
+    free(line_ref_t *ref)
+    {
+        *reinterpret_cast<void **>(ref) = free_;
+        free_ = ref;
+    }
+
+    size_t
+    bytes() const
+    {
+        return slabs_.size() * SLAB_LINES * record_size_;
+    }
+
+private:
+    line_pool_t(const line_pool_t &);
+    line_pool_t &
+    operator=(const line_pool_t &);
+
+    bool linked_;
+    size_t record_size_;
+    std::vector<char *> slabs_;
+    void *free_;
+    size_t slab_used_;
+};
+
+/* A shard's top lines by references (table 0) or by distant references
+ * (table 1), kept as the counts grow so the report needs no sort over every
+ * line.  The heap holds the size best lines with the weakest at the root.
+ * Counts only grow, so a line gets in only by passing the root, which it then
+ * replaces; the heap is exact until sampling drops one of its lines.
+ */
+struct line_top_t {
+    line_top_t(int table, size_t size)
+        : table_(table)
+        , size_(size)
+    {
+        heap_.reserve(size);
+    }
+
+    // Whether l belongs ahead of r: more references (distant ones for table
+    // 1), then more of the other kind, then the lower tag.
+    bool
+    ranks_above(const line_ref_t *l, const line_ref_t *r) const
+    {
+        uint64_t l_first = table_ == 0 ? l->total_refs : l->distant_refs;
+        uint64_t r_first = table_ == 0 ? r->total_refs : r->distant_refs;
+        if (l_first != r_first)
+            return l_first > r_first;
+        uint64_t l_second = table_ == 0 ? l->distant_refs : l->total_refs;
+        uint64_t r_second = table_ == 0 ? r->distant_refs : r->total_refs;
+        if (l_second != r_second)
+            return l_second > r_second;
+        return l->tag < r->tag;
+    }
+
+    // Call for a new line and whenever a line's counts grow.
+    void
+    update(line_ref_t *ref)
+    {
+        int32_t &pos = ref->top_pos[table_];
+        if (pos >= 0) {
+            sift_down(pos);
+        } else if (heap_.size() < size_) {
+            pos = static_cast<int32_t>(heap_.size());
+            heap_.push_back(ref);
+            sift_up(pos);
+        } else if (size_ > 0 && ranks_above(ref, heap_[0])) {
+            heap_[0]->top_pos[table_] = -1;
+            heap_[0] = ref;
+            pos = 0;
+            sift_down(0);
+        }
+    }
+
+    // Call before a line is dropped.
+    void
+    remove(line_ref_t *ref)
+    {
+        int32_t pos = ref->top_pos[table_];
+        if (pos < 0)
+            return;
+        ref->top_pos[table_] = -1;
+        line_ref_t *last = heap_.back();
+        heap_.pop_back();
+        if (static_cast<size_t>(pos) < heap_.size()) {
+            heap_[pos] = last;
+            last->top_pos[table_] = pos;
+            sift_down(pos);
+            sift_up(pos);
+        }
+        // The best line outside the heap is unknown now.
+        exact_ = false;
+    }
+
+    bool
+    exact() const
+    {
+        return exact_;
+    }
+
+    void
+    set_exact(bool exact)
+    {
+        exact_ = exact;
+    }
+
+    // The primary count of the weakest line, which every line outside a full
+    // heap is at or below; 0 while the heap has room.
+    uint64_t
+    floor() const
+    {
+        if (heap_.size() < size_ || heap_.empty())
+            return 0;
+        return table_ == 0 ? heap_[0]->total_refs : heap_[0]->distant_refs;
+    }
+
+    uint64_t
+    count(const line_ref_t *ref) const
+    {
+        return table_ == 0 ? ref->total_refs : ref->distant_refs;
+    }
+
+    // Starts over from every line of the shard, e.g. once !exact().
+    template <typename map_t>
+    void
+    rebuild(const map_t &lines)
+    {
+        for (line_ref_t *ref : heap_)
+            ref->top_pos[table_] = -1;
+        heap_.clear();
+        for (const auto &entry : lines)
+            update(entry.second);
+        exact_ = true;
+    }
+
+    // Best first.
+    std::vector<line_ref_t *>
+    sorted() const
+    {
+        std::vector<line_ref_t *> lines(heap_);
+        std::sort(lines.begin(), lines.end(),
+                  [this](const line_ref_t *l, const line_ref_t *r) {
+                      return ranks_above(l, r);
+                  });
+        return lines;
+    }
+
+    const std::vector<line_ref_t *> &
+    lines() const
+    {
+        return heap_;
+    }
+
+private:
+    void
+    heap_swap(size_t i, size_t j)
+    {
+        std::swap(heap_[i], heap_[j]);
+        heap_[i]->top_pos[table_] = static_cast<int32_t>(i);
+        heap_[j]->top_pos[table_] = static_cast<int32_t>(j);
+    }
+
+    void
+    sift_up(size_t i)
+    {
+        while (i > 0 && ranks_above(heap_[(i - 1) / 2], heap_[i])) {
+            heap_swap(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+
+    void
+    sift_down(size_t i)
+    {
+        for (;;) {
+            size_t weakest = i;
+            size_t child = 2 * i + 1;
+            if (child < heap_.size() && ranks_above(heap_[weakest], heap_[child]))
+                weakest = child;
+            if (child + 1 < heap_.size() && ranks_above(heap_[weakest], heap_[child + 1]))
+                weakest = child + 1;
+            if (weakest == i)
+                return;
+            heap_swap(i, weakest);
+            i = weakest;
+        }
+    }
+
+    int table_;
+    size_t size_;
+    std::vector<line_ref_t *> heap_;
+    bool exact_ = true;
+};
+
+/* A shard's accesses for replaying all shards as one stream, in chunks that
+ * are interleaved with the other shards' chunks by key.  The shared-cache log
+ * holds a tag and a flags byte per access; the sharing log holds the address,
+ * the access_kind_t in flags, and the size.  Every BUFFER_ENTRIES accesses the
+ * buffered chunks are appended to the log's file as a block, so a log holds
+ * one block in memory however long the trace; a chunk cut by a block boundary
+ * goes on in the next block under the same key.
+ */
+struct shared_log_t {
+    // The access_kind_t is in the low two bits.
+    static const uint8_t PRIVATE_REUSE = 1 << 2; // not a first touch in the shard
+    static const uint8_t PRIVATE_NEAR = 1 << 3;  // and under the distance threshold
+    static const size_t BUFFER_ENTRIES = 1 << 12;
+
+    struct chunk_t {
+        uint64_t key;
+        uint64_t begin; // the chunk runs to the next chunk's begin
+    };
+
+    // A block in the file: this header, the chunks, the tags, the flags and
+    // the sizes, if any.
+    struct block_header_t {
+        uint64_t chunks;
+        uint64_t entries;
+        uint64_t sizes;
+    };
+
+    // The file at path starts over unless keep is set, for a resumed shard
+    // to cut back with restore().  It goes with the log.
+    shared_log_t(const std::string &path, bool with_sizes, bool keep)
+        : path(path)
+        , with_sizes(with_sizes)
+    {
+        tags.reserve(BUFFER_ENTRIES);
+        flags.reserve(BUFFER_ENTRIES);
+        if (with_sizes)
+            sizes.reserve(BUFFER_ENTRIES);
+        if (!keep)
+            remove(path.c_str());
+    }
+
+    ~shared_log_t()
+    {
+        remove(path.c_str());
+    }
+
+    void
+    start_chunk(uint64_t key)
+    {
+        if (!chunks.empty() && chunks.back().begin == tags.size())
+            chunks.back().key = key;
+        else
+            chunks.push_back({ key, tags.size() });
+    }
+
+    void
+    add(addr_t tag, uint8_t flag)
+    {
+        tags.push_back(tag);
+        flags.push_back(flag);
+        if (tags.size() >= BUFFER_ENTRIES)
+            spill();
+    }
+
+    void
+    add(addr_t addr, uint8_t kind, uint16_t size)
+    {
+        sizes.push_back(size);
+        add(addr, kind);
+    }
+
+    // Appends the buffered chunks to the file as a block, leaving the last
+    // chunk open and empty.  An I/O error sets failed.
+    void
+    spill();
+
+    // Cuts the file back to a checkpoint's length, with the chunk then open
+    // under key.  Returns false when the file is shorter.
+    bool
+    restore(uint64_t key, uint64_t length);
+
+    size_t
+    bytes() const
+    {
+        return chunks.capacity() * sizeof(chunk_t) + tags.capacity() * sizeof(addr_t) +
+            flags.capacity() + sizes.capacity() * sizeof(uint16_t);
+    }
+
+    const std::string path;
+    const bool with_sizes;
+    // The bytes in the file.
+    uint64_t length = 0;
+    bool failed = false;
+    std::vector<chunk_t> chunks;
+    std::vector<addr_t> tags;
+    std::vector<uint8_t> flags;
+    std::vector<uint16_t> sizes;
+};
+
+/* Reads a shared_log_t's file back a block at a time, closing it in between
+ * so merging many shards' logs holds one block per shard and no descriptors.
+ * The chunk under the cursor is chunk(), running over [begin(), end()) of the
+ * block's entries.
+ */
+struct log_reader_t {
+    explicit log_reader_t(const shared_log_t *log)
+        : log_(log)
+    {
+    }
+
+    // Moves to the next chunk, loading the next block when this one is done.
+    // Returns false at the end of the log, or with error set.
+    bool
+    next();
+
+    const std::string &
+    path() const
+    {
+        return log_->path;
+    }
+    const shared_log_t::chunk_t &
+    chunk() const
+    {
+        return chunks[cursor_];
+    }
+    size_t
+    begin() const
+    {
+        return chunks[cursor_].begin;
+    }
+    size_t
+    end() const
+    {
+        return cursor_ + 1 < chunks.size() ? chunks[cursor_ + 1].begin : tags.size();
+    }
+
+    bool error = false;
+    std::vector<shared_log_t::chunk_t> chunks;
+    std::vector<addr_t> tags;
+    std::vector<uint8_t> flags;
+    std::vector<uint16_t> sizes;
+
+private:
+    const shared_log_t *log_;
+    uint64_t offset_ = 0;
+    size_t cursor_ = 0;
+};
+
+/* A checkpoint segment being built, or one read back: plain values and
+ * vectors of them, copied bytewise in native byte order.  A short read
+ * clears ok and yields zeros from then on.
+ */
+struct snapshot_buffer_t {
+    std::vector<char> data;
+    size_t pos = 0;
+    bool ok = true;
+
+    template <typename T>
+    void
+    put(const T &value)
+    {
+        const char *bytes = reinterpret_cast<const char *>(&value);
+        data.insert(data.end(), bytes, bytes + sizeof(T));
+    }
+
+    // Just the elements from from on.
+    template <typename T>
+    void
+    put_vector(const std::vector<T> &values, size_t from = 0)
+    {
+        put<uint64_t>(values.size() - from);
+        const char *bytes = reinterpret_cast<const char *>(values.data() + from);
+        data.insert(data.end(), bytes, bytes + (values.size() - from) * sizeof(T));
+    }
+
+    template <typename T>
+    T
+    get()
+    {
+        T value = T();
+        if (ok && data.size() - pos >= sizeof(T)) {
+            memcpy(&value, data.data() + pos, sizeof(T));
+            pos += sizeof(T);
+        } else
+            ok = false;
+        return value;
+    }
+
+    // Replaces the elements from from on with those read.
+    template <typename T>
+    void
+    get_vector(std::vector<T> *values, size_t from = 0)
+    {
+        uint64_t count = get<uint64_t>();
+        if (!ok || from > values->size() || (data.size() - pos) / sizeof(T) < count) {
+            ok = false;
+            return;
+        }
+        values->resize(from + count);
+        memcpy(values->data() + from, data.data() + pos, count * sizeof(T));
+        pos += count * sizeof(T);
+    }
+};
+
+/* A log-linear (HDR-style) histogram of 64-bit values with a fixed footprint.
+ * Every power-of-two octave is cut into 2^sub_bits equal buckets, so a value
+ * lands in a bucket no wider than 2^-sub_bits of itself and values below
+ * 2^(sub_bits+1) are kept exactly.  The bucket comes from the leading-zero
+ * count alone, and the moments are kept in exact 128-bit sums, so the mean,
+ * the deviation and any percentile are answered without sorting anything.
+ */
+struct log_histogram_t {
+    static const int MAX_SUB_BITS = 16;
+
+    explicit log_histogram_t(int sub_bits)
+        : sub_bits_(std::min(std::max(sub_bits, 0), MAX_SUB_BITS))
+        , counts_(static_cast<size_t>(65 - sub_bits_) << sub_bits_, 0)
+    {
+    }
+
+    size_t
+    bucket(uint64_t value) const
+    {
+        int msb = 63 - __builtin_clzll(value | 1);
+        int shift = std::max(msb - sub_bits_, 0);
+        return (static_cast<size_t>(shift) << sub_bits_) + (value >> shift);
+    }
+
+    void
+    add(uint64_t value, uint64_t weight)
+    {
+        counts_[bucket(value)] += weight;
+        count_ += weight;
+        sum_ += (__uint128_t)value * weight;
+        sqsum_ += (__uint128_t)value * value * weight;
+    }
+
+    // Both histograms must have the same sub_bits.
+    void
+    merge(const log_histogram_t &other)
+    {
+        assert(other.sub_bits_ == sub_bits_);
+        for (size_t i = 0; i < counts_.size(); ++i)
+            counts_[i] += other.counts_[i];
+        count_ += other.count_;
+        sum_ += other.sum_;
+        sqsum_ += other.sqsum_;
+    }
+
+    // Takes away an earlier snapshot of this same histogram.
+    void
+    subtract(const log_histogram_t &base)
+    {
+        assert(base.sub_bits_ == sub_bits_);
+        for (size_t i = 0; i < counts_.size(); ++i)
+            counts_[i] -= base.counts_[i];
+        count_ -= base.count_;
+        sum_ -= base.sum_;
+        sqsum_ -= base.sqsum_;
+    }
+
+    size_t
+    buckets() const
+    {
+        return counts_.size();
+    }
+
+    uint64_t
+    bucket_count(size_t index) const
+    {
+        return counts_[index];
+    }
+
+    // The smallest value recorded into the bucket.
+    uint64_t
+    bucket_low(size_t index) const
+    {
+        if (index < (static_cast<size_t>(2) << sub_bits_))
+            return index;
+        int shift = static_cast<int>(index >> sub_bits_) - 1;
+        return static_cast<uint64_t>(index - (static_cast<size_t>(shift) << sub_bits_))
+            << shift;
+    }
+
+    // The number of values the bucket covers.
+    uint64_t
+    bucket_width(size_t index) const
+    {
+        if (index < (static_cast<size_t>(2) << sub_bits_))
+            return 1;
+        return static_cast<uint64_t>(1) << ((index >> sub_bits_) - 1);
+    }
+
+    // The total weight of the values below value, taking the values within
+    // its bucket as evenly spread.  Exact at bucket bounds.
+    double
+    count_below(uint64_t value) const
+    {
+        size_t end = bucket(value);
+        uint64_t total = 0;
+        for (size_t i = 0; i < end; ++i)
+            total += counts_[i];
+        return total +
+            counts_[end] * static_cast<double>(value - bucket_low(end)) / bucket_width(end);
+    }
+
+    // The total weight of the values in [low, high).  Buckets never straddle a
+    // power of two, so octave bounds give exact counts.
+    uint64_t
+    count_between(uint64_t low, uint64_t high) const
+    {
+        uint64_t total = 0;
+        for (size_t i = bucket(low); i < counts_.size() && bucket_low(i) < high; ++i)
+            total += counts_[i];
+        return total;
+    }
+
+    // The counts folded by power of two: [0] holds the value 0 and [k + 1]
+    // holds [2^k, 2^(k+1)).  Trailing empty octaves are left off.
+    std::vector<uint64_t>
+    octaves() const
+    {
+        std::vector<uint64_t> folded;
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            if (counts_[i] == 0)
+                continue;
+            uint64_t low = bucket_low(i);
+            size_t octave = low == 0 ? 0 : 64 - __builtin_clzll(low);
+            if (folded.size() <= octave)
+                folded.resize(octave + 1, 0);
+            folded[octave] += counts_[i];
+        }
+        return folded;
+    }
+
+    // The lowest value with at least fraction of the weight at or below it,
+    // to within a bucket.
+    uint64_t
+    percentile(double fraction) const
+    {
+        uint64_t target = static_cast<uint64_t>(fraction * count_);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i];
+            if (counts_[i] > 0 && seen >= target)
+                return bucket_low(i);
+        }
+        return 0;
+    }
+
+    uint64_t
+    count() const
+    {
+        return count_;
+    }
+
+    __uint128_t
+    sum() const
+    {
+        return sum_;
+    }
+
+    __uint128_t
+    sqsum() const
+    {
+        return sqsum_;
+    }
+
+    int
+    sub_bits() const
+    {
+        return sub_bits_;
+    }
+
+    void
+    save(snapshot_buffer_t *out) const
+    {
+        out->put_vector(counts_);
+        out->put(count_);
+        out->put(sum_);
+        out->put(sqsum_);
+    }
+
+    // Only into a histogram with the same sub_bits.
+    void
+    load(snapshot_buffer_t *in)
+    {
+        size_t buckets = counts_.size();
+        in->get_vector(&counts_);
+        if (counts_.size() != buckets) {
+            in->ok = false;
+            counts_.resize(buckets);
+        }
+        count_ = in->get<uint64_t>();
+        sum_ = in->get<__uint128_t>();
+        sqsum_ = in->get<__uint128_t>();
+    }
+
+    double
+    mean() const
+    {
+        return count_ == 0 ? 0. : static_cast<double>(sum_) / count_;
+    }
+
+    double
+    stddev() const
+    {
+        if (count_ == 0)
+            return 0.;
+        double mean_value = mean();
+        double variance = static_cast<double>(sqsum_) / count_ - mean_value * mean_value;
+        return std::sqrt(std::max(variance, 0.));
+    }
+
+private:
+    int sub_bits_;
+    std::vector<uint64_t> counts_;
+    uint64_t count_ = 0;
+    __uint128_t sum_ = 0;
+    __uint128_t sqsum_ = 0;
+};
+
+/* The instructions behind a shard's reuses, in fixed memory (Space-Saving).
+ * Up to capacity pcs are monitored; a reuse by any other pc takes over the
+ * entry with the fewest reuses and inherits its count, which is then the most
+ * the new pc's count can be overstated by.  Every pc with more than 1/capacity
+ * of the reuses is sure to hold an entry.  A min-heap picks the entry to take
+ * over and an open-addressing index finds a pc's entry; both are sized up
+ * front, so a reuse never allocates.
+ */
+struct pc_summary_t {
+    struct entry_t {
+        addr_t pc;
+        uint64_t reuses; // overstated by at most error
+        uint64_t error;
+        // Only since this pc took the entry, i.e. over reuses - error reuses.
+        uint64_t distant;
+        __uint128_t dist_sum;
+    };
+
+    explicit pc_summary_t(size_t capacity)
+        : capacity_(std::max<size_t>(capacity, 1))
+    {
+        bits_ = 1;
+        while ((static_cast<size_t>(1) << bits_) < 2 * capacity_)
+            ++bits_;
+        mask_ = (static_cast<size_t>(1) << bits_) - 1;
+        index_.assign(mask_ + 1, 0);
+        entries_.reserve(capacity_);
+        heap_.reserve(capacity_);
+        pos_.reserve(capacity_);
+    }
+
+    void
+    add(addr_t pc, uint64_t dist, uint64_t weight, bool distant)
+    {
+        total_ += weight;
+        size_t slot = find_slot(pc);
+        uint32_t entry = index_[slot];
+        if (entry == 0) {
+            if (entries_.size() < capacity_) {
+                entries_.push_back(entry_t());
+                heap_.push_back(static_cast<uint32_t>(entries_.size() - 1));
+                pos_.push_back(static_cast<uint32_t>(heap_.size() - 1));
+                entry = static_cast<uint32_t>(entries_.size());
+                entries_.back().reuses = 0;
+                sift_up(pos_.back());
+            } else {
+                // Take over the least counted entry.
+                entry = heap_[0] + 1;
+                erase_index(entries_[entry - 1].pc);
+                slot = find_slot(pc);
+            }
+            entry_t &taken = entries_[entry - 1];
+            taken.pc = pc;
+            taken.error = taken.reuses;
+            taken.distant = 0;
+            taken.dist_sum = 0;
+            index_[slot] = entry;
+        }
+        entry_t &counted = entries_[entry - 1];
+        counted.reuses += weight;
+        if (distant)
+            counted.distant += weight;
+        counted.dist_sum += (__uint128_t)dist * weight;
+        sift_down(pos_[entry - 1]);
+    }
+
+    // Folds in another summary of the same capacity: counts add up, a pc one
+    // side lacks gets that side's smallest count as extra error if that side
+    // was full, and the capacity largest results are kept.
+    void
+    merge(const pc_summary_t &other)
+    {
+        std::unordered_map<addr_t, entry_t> combined;
+        for (const entry_t &entry : entries_) {
+            entry_t &sum = combined[entry.pc] = entry;
+            if (other.full() && other.find(entry.pc) == NULL) {
+                sum.reuses += other.min_reuses();
+                sum.error += other.min_reuses();
+            }
+        }
+        for (const entry_t &entry : other.entries_) {
+            auto it = combined.find(entry.pc);
+            if (it == combined.end()) {
+                entry_t &sum = combined[entry.pc] = entry;
+                if (full()) {
+                    sum.reuses += min_reuses();
+                    sum.error += min_reuses();
+                }
+                continue;
+            }
+            it->second.reuses += entry.reuses;
+            it->second.error += entry.error;
+            it->second.distant += entry.distant;
+            it->second.dist_sum += entry.dist_sum;
+        }
+        std::vector<entry_t> kept;
+        kept.reserve(combined.size());
+        for (const auto &it : combined)
+            kept.push_back(it.second);
+        // Ties go to the lower pc so the result does not depend on hashing.
+        std::sort(kept.begin(), kept.end(), [](const entry_t &l, const entry_t &r) {
+            return l.reuses != r.reuses ? l.reuses > r.reuses : l.pc < r.pc;
+        });
+        if (kept.size() > capacity_)
+            kept.resize(capacity_);
+        total_ += other.total_;
+        rebuild(kept);
+    }
+
+    const entry_t *
+    find(addr_t pc) const
+    {
+        uint32_t entry = index_[find_slot(pc)];
+        return entry == 0 ? NULL : &entries_[entry - 1];
+    }
+
+    const std::vector<entry_t> &
+    entries() const
+    {
+        return entries_;
+    }
+
+    size_t
+    capacity() const
+    {
+        return capacity_;
+    }
+
+    // The weighted reuses seen, monitored or not.
+    uint64_t
+    total() const
+    {
+        return total_;
+    }
+
+    void
+    save(snapshot_buffer_t *out) const
+    {
+        out->put(total_);
+        out->put_vector(entries_);
+        out->put_vector(heap_);
+        out->put_vector(pos_);
+    }
+
+    // Only into a summary of the same capacity.
+    void
+    load(snapshot_buffer_t *in)
+    {
+        total_ = in->get<uint64_t>();
+        in->get_vector(&entries_);
+        in->get_vector(&heap_);
+        in->get_vector(&pos_);
+        if (entries_.size() > capacity_ || heap_.size() != entries_.size() ||
+            pos_.size() != entries_.size()) {
+            in->ok = false;
+            entries_.clear();
+            heap_.clear();
+            pos_.clear();
+        }
+        std::fill(index_.begin(), index_.end(), 0);
+        for (size_t i = 0; i < entries_.size(); ++i)
+            index_[find_slot(entries_[i].pc)] = static_cast<uint32_t>(i + 1);
+    }
+
+private:
+    bool
+    full() const
+    {
+        return entries_.size() == capacity_;
+    }
+
+    uint64_t
+    min_reuses() const
+    {
+        return heap_.empty() ? 0 : entries_[heap_[0]].reuses;
+    }
+
+    size_t
+    home(addr_t pc) const
+    {
+        return static_cast<size_t>((pc * 0x9e3779b97f4a7c15ULL) >> (64 - bits_));
+    }
+
+    // The pc's slot in the index, or the empty slot that would take it.
+    size_t
+    find_slot(addr_t pc) const
+    {
+        size_t i = home(pc);
+        while (index_[i] != 0 && entries_[index_[i] - 1].pc != pc)
+            i = (i + 1) & mask_;
+        return i;
+    }
+
+    // As line_map_t::erase.
+    void
+    erase_index(addr_t pc)
+    {
+        size_t hole = find_slot(pc);
+        for (size_t i = (hole + 1) & mask_; index_[i] != 0; i = (i + 1) & mask_) {
+            if (((i - home(entries_[index_[i] - 1].pc)) & mask_) >= ((i - hole) & mask_)) {
+                index_[hole] = index_[i];
+                hole = i;
+            }
+        }
+        index_[hole] = 0;
+    }
+
+    bool
+    heap_less(size_t l, size_t r) const
+    {
+        return entries_[heap_[l]].reuses < entries_[heap_[r]].reuses;
+    }
+
+    void
+    heap_swap(size_t l, size_t r)
+    {
+        std::swap(heap_[l], heap_[r]);
+        pos_[heap_[l]] = static_cast<uint32_t>(l);
+        pos_[heap_[r]] = static_cast<uint32_t>(r);
+    }
+
+    void
+    sift_up(size_t i)
+    {
+        while (i > 0 && heap_less(i, (i - 1) / 2)) {
+            heap_swap(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+
+    // Counts only grow, so an entry only ever moves away from the root.
+    void
+    sift_down(size_t i)
+    {
+        for (;;) {
+            size_t least = i;
+            size_t child = 2 * i + 1;
+            if (child < heap_.size() && heap_less(child, least))
+                least = child;
+            if (child + 1 < heap_.size() && heap_less(child + 1, least))
+                least = child + 1;
+            if (least == i)
+                return;
+            heap_swap(i, least);
+            i = least;
+        }
+    }
+
+    void
+    rebuild(const std::vector<entry_t> &entries)
+    {
+        entries_ = entries;
+        heap_.resize(entries_.size());
+        pos_.resize(entries_.size());
+        std::fill(index_.begin(), index_.end(), 0);
+        for (size_t i = 0; i < entries_.size(); ++i) {
+            heap_[i] = static_cast<uint32_t>(i);
+            pos_[i] = static_cast<uint32_t>(i);
+            index_[find_slot(entries_[i].pc)] = static_cast<uint32_t>(i + 1);
+        }
+        for (size_t i = heap_.size() / 2; i > 0; --i)
+            sift_down(i - 1);
+    }
+
+    size_t capacity_;
+    std::vector<entry_t> entries_;
+    std::vector<uint32_t> heap_;  // entry indices, fewest reuses first
+    std::vector<uint32_t> pos_;   // each entry's place in heap_
+    std::vector<uint32_t> index_; // entry index + 1 by pc hash, 0 for empty
+    size_t bits_;
+    size_t mask_;
+    uint64_t total_ = 0;
+};
+
+/* A set-associative LRU cache of sets x ways lines beside a fully associative
+ * LRU cache of the same capacity, both fed the same lines.  A miss in the
+ * first that hits in the second is a conflict miss.  A set's stack is its
+ * ways' tags, most recent first, so an access costs at most a scan of one
+ * set; the fully associative cache is a line_list_ref_t list with a line_map_t.
+ */
+struct set_model_t {
+    // Both must be positive.
+    set_model_t(uint64_t sets, int ways)
+        : set_refs(sets, 0)
+        , set_misses(sets, 0)
+        , set_conflicts(sets, 0)
+        , sets_(sets)
+        , ways_(ways)
+        , tags_(sets * ways, 0)
+        , fill_(sets, 0)
+        , pool_(true)
+        , head_(NULL)
+        , tail_(NULL)
+    {
+    }
+
+    void
+    access(addr_t line)
+    {
+        uint64_t set = line % sets_;
+        bool set_hit = access_set(set, line);
+        bool full_hit = access_full(line);
+        ++refs;
+        ++set_refs[set];
+        if (!set_hit) {
+            ++misses;
+            ++set_misses[set];
+            if (full_hit) {
+                ++conflicts;
+                ++set_conflicts[set];
+            }
+        }
+        if (!full_hit)
+            ++full_misses;
+    }
+
+    // Sums another model of the same geometry into this one.
+    void
+    merge(const set_model_t &other)
+    {
+        assert(other.sets_ == sets_ && other.ways_ == ways_);
+        refs += other.refs;
+        misses += other.misses;
+        full_misses += other.full_misses;
+        conflicts += other.conflicts;
+        for (uint64_t set = 0; set < sets_; ++set) {
+            set_refs[set] += other.set_refs[set];
+            set_misses[set] += other.set_misses[set];
+            set_conflicts[set] += other.set_conflicts[set];
+        }
+    }
+
+    uint64_t
+    sets() const
+    {
+        return sets_;
+    }
+
+    int
+    ways() const
+    {
+        return ways_;
+    }
+
+    void
+    save(snapshot_buffer_t *out) const
+    {
+        out->put(refs);
+        out->put(misses);
+        out->put(full_misses);
+        out->put(conflicts);
+        out->put_vector(set_refs);
+        out->put_vector(set_misses);
+        out->put_vector(set_conflicts);
+        out->put_vector(tags_);
+        out->put_vector(fill_);
+        // The fully associative cache's lines, least recent first.
+        std::vector<addr_t> lines;
+        for (const line_list_ref_t *ref = tail_; ref != NULL; ref = ref->prev)
+            lines.push_back(ref->tag);
+        out->put_vector(lines);
+    }
+
+    // Only into an empty model of the same geometry.
+    void
+    load(snapshot_buffer_t *in)
+    {
+        refs = in->get<uint64_t>();
+        misses = in->get<uint64_t>();
+        full_misses = in->get<uint64_t>();
+        conflicts = in->get<uint64_t>();
+        in->get_vector(&set_refs);
+        in->get_vector(&set_misses);
+        in->get_vector(&set_conflicts);
+        in->get_vector(&tags_);
+        in->get_vector(&fill_);
+        std::vector<addr_t> lines;
+        in->get_vector(&lines);
+        if (set_refs.size() != sets_ || set_misses.size() != sets_ ||
+            set_conflicts.size() != sets_ || tags_.size() != sets_ * ways_ ||
+            fill_.size() != sets_ || lines.size() > sets_ * ways_) {
+            in->ok = false;
+            return;
+        }
+        for (addr_t line : lines)
+            access_full(line);
+    }
+
+    uint64_t refs = 0;
+    uint64_t misses = 0;      // in the set-associative cache
+    uint64_t full_misses = 0; // in the fully associative one
+    uint64_t conflicts = 0;   // misses that the fully associative cache hits
+    std::vector<uint64_t> set_refs;
+    std::vector<uint64_t> set_misses;
+    std::vector<uint64_t> set_conflicts;
+
+private:
+    bool
+    access_set(uint64_t set, addr_t line)
+    {
+        addr_t *stack = &tags_[set * ways_];
+        int depth = 0;
+        while (depth < fill_[set] && stack[depth] != line)
+            ++depth;
+        bool hit = depth < fill_[set];
+        if (!hit) {
+            if (fill_[set] < ways_)
+                ++fill_[set];
+            depth = fill_[set] - 1; // the LRU way, if the set was full
+        }
+        memmove(stack + 1, stack, depth * sizeof(*stack));
+        stack[0] = line;
+        return hit;
+    }
+
+    bool
+    access_full(addr_t line)
+    {
+        line_list_ref_t *ref = static_cast<line_list_ref_t *>(map_.find(line));
+        bool hit = ref != NULL;
+        if (hit)
+            unlink(ref);
+        else {
+            if (map_.size() == sets_ * ways_) {
+                line_list_ref_t *victim = tail_;
+                unlink(victim);
+                map_.erase(victim->tag);
+                pool_.free(victim);
+            }
+            ref = static_cast<line_list_ref_t *>(pool_.alloc(line));
+            map_.insert(line, ref);
+        }
+        ref->prev = NULL;
+        ref->next = head_;
+        if (head_ != NULL)
+            head_->prev = ref;
+        head_ = ref;
+        if (tail_ == NULL)
+            tail_ = ref;
+        return hit;
+    }
+
+    void
+    unlink(line_list_ref_t *ref)
+    {
+        if (ref->prev != NULL)
+            ref->prev->next = ref->next;
+        else
+            head_ = ref->next;
+        if (ref->next != NULL)
+            ref->next->prev = ref->prev;
+        else
+            tail_ = ref->prev;
+    }
+
+    uint64_t sets_;
+    int ways_;
+    std::vector<addr_t> tags_;
+    std::vector<int> fill_;
+    line_map_t map_;
+    line_pool_t pool_;
+    line_list_ref_t *head_; // most recent
+    line_list_ref_t *tail_;
+};
+
+// We assume that the shard unit is the unit over which we should measure
+// distance.  By default this is a traced thread.  For serial operation we look
+// at the tid values and enforce it to be a thread, but for parallel we just use
+// the shards we're given.  This is for simplicity and to give the user a method
+// for computing over different units if for some reason that was desired.
+struct reuse_distance_t::shard_data_t {
+    shard_data_t(uint64_t reuse_threshold, uint64_t skip_dist, bool verify,
+                 reuse_engine_t engine, int hist_bits, size_t top_lines);
+    // The count of unique accesses kept by whichever engine is in use.
+    uint64_t &
+    cur_time();
+    uint64_t
+    cur_time() const;
+    void
+    set_sample_threshold(uint64_t threshold);
+    // Drops every sampled line whose hash is at or above the threshold
+    // until at most max_lines remain (fixed-size SHARDS).
+    void
+    shrink_sample(size_t max_lines);
+    line_map_t cache_map;
+    line_pool_t line_pool;
+    // The report's line tables, 0 by references and 1 by distant references.
+    line_top_t top[2];
+    // The aggregate keeps no lines of its own, only the shards' line counts
+    // (weighted, and as sampled) and the records of its top lines.
+    uint64_t merged_lines = 0;
+    uint64_t merged_sampled_lines = 0;
+    uint64_t
+    unique_lines() const
+    {
+        return cache_map.size() * sample_weight + merged_lines;
+    }
+    uint64_t
+    sampled_lines() const
+    {
+        return cache_map.size() + merged_sampled_lines;
+    }
+    // This is our reuse distance histogram.
+    log_histogram_t dist_hist;
+    // The same reuses split by reuse_kind_t.
+    std::vector<log_histogram_t> kind_hist;
+    // At most one of these computes the stack distance: the skip list walks
+    // the LRU order while the tree counts timestamps in O(log n).  With
+    // neither, only reuse times are kept and untracked_time counts the
+    // accesses that, as with the engines, are not a repeat of the most
+    // recent line, whose last_ref is untracked_last.
+    std::unique_ptr<line_ref_list_t> ref_list;
+    std::unique_ptr<line_ref_tree_t> ref_tree;
+    uint64_t untracked_time = 0;
+    uint64_t untracked_last = 0;
+    int_least64_t total_refs = 0;
+    // Reuse time: the number of this shard's references since a line's previous
+    // access.  First touches have no reuse time and are only counted.
+    uint64_t cur_ref = 0;
+    log_histogram_t time_hist;
+    uint64_t first_touches = 0;
+    // The first touches by cur_ref, and the footprint theory's misses for
+    // each miss ratio curve size (1K << i bytes), summed over the shards in
+    // the aggregate.
+    log_histogram_t first_hist;
+    std::vector<double> footprint_misses;
+    // SHARDS sampling state.  Each reference to a sampled tag stands for
+    // sample_weight references (1/rate, rounded), so the histograms and the
+    // counters below already hold full-trace estimates.
+    uint64_t reuse_threshold;
+    uint64_t sample_threshold = SAMPLE_MODULUS;
+    int_least64_t sample_weight = 1;
+    int_least64_t sampled_refs = 0;   // weighted, to check against total_refs
+    int_least64_t sampled_reuses = 0; // unweighted
+    // For the fixed-size mode: the sampled tags keyed by hash, largest first.
+    std::priority_queue<std::pair<uint64_t, addr_t>> sample_heap;
+    // The reuses of this granularity by the instruction that made them.
+    std::unique_ptr<pc_summary_t> pcs;
+    // The first granularity's -line_size lines through the set-associative
+    // model, sampled or not.
+    std::unique_ptr<set_model_t> set_model;
+    // The first granularity's accesses, in shared-cache mode, and the data
+    // accesses in sharing mode.
+    std::unique_ptr<shared_log_t> shared_log;
+    std::unique_ptr<shared_log_t> sharing_log;
+    // Cuts each log the shard keeps for a new chunk of the interleaving.
+    void
+    start_chunk(uint64_t key)
+    {
+        if (shared_log)
+            shared_log->start_chunk(key);
+        if (sharing_log)
+            sharing_log->start_chunk(key);
+    }
+    // The tag is the address shifted right by line_bits, with accesses that
+    // straddle tags split; 0 takes the whole address, unsplit.
+    int line_bits = 0;
+    // The granularities after the first, each with its own lines and
+    // histograms.  Only a shard's first granularity holds these; grain()
+    // walks them all starting from this one.
+    std::vector<std::unique_ptr<shard_data_t>> extra_grains;
+    size_t
+    grains() const
+    {
+        return 1 + extra_grains.size();
+    }
+    shard_data_t *
+    grain(size_t i)
+    {
+        return i == 0 ? this : extra_grains[i - 1].get();
+    }
+    const shard_data_t *
+    grain(size_t i) const
+    {
+        return i == 0 ? this : extra_grains[i - 1].get();
+    }
+    // Interval snapshots: where the current interval began, and the
+    // histograms as they stood then (allocated at the first record).  The
+    // count and timestamps are kept by the first granularity only.
+    int_least64_t index = 0;
+    uint64_t interval_count = 0;
+    uint64_t interval_start_ref = 0;
+    uint64_t interval_start_usec = 0;
+    uint64_t interval_first_touches = 0;
+    uint64_t last_usec = 0;
+    std::unique_ptr<log_histogram_t> interval_dist_base;
+    std::unique_ptr<log_histogram_t> interval_time_base;
+    // The records passed to the shard, and how many of the first of them a
+    // resumed shard's checkpoint already covers.
+    uint64_t records = 0;
+    uint64_t skip_records = 0;
+    // Checkpoint state as of the last one queued: the lines marked dirty,
+    // listed in dirty_tags (both kept per granularity), are what changed
+    // since, and the file and its last whole rewrite have these sizes.  A tag
+    // is listed once per time it turns dirty, and may have been dropped by
+    // sampling since.
+    std::vector<addr_t> dirty_tags;
+    uint64_t checkpoint_bytes = 0;
+    uint64_t checkpoint_full_bytes = 0;
+    // Whether the shard's last segment is still queued, and whether writing
+    // one failed, so the next must rewrite the file whole.
+    bool checkpoint_pending = false;
+    bool checkpoint_failed = false;
+    // Telemetry: the run time and record count at the last stats line.
+    uint64_t stats_usec = 0;
+    uint64_t stats_records = 0;
+    // The bytes held by the granularity's lines and engine.
+    size_t
+    table_bytes() const
+    {
+        return cache_map.bytes() + line_pool.bytes() + (ref_tree ? ref_tree->bytes() : 0);
+    }
+    // Ideally the shard index would be the tid when shard==thread but that's
+    // not the case today so we store the tid.
+    memref_tid_t tid = 0;
+    std::string error;
+};
+
+/* The tool for one stream policy.  The policy's constants fold the record
+ * selection at compile time, so the per-record path does no mode checks.
+ */
+template <typename stream_t> class reuse_stream_tool_t : public reuse_distance_t {
+public:
+    explicit reuse_stream_tool_t(const reuse_distance_knobs_t &knobs)
+        : reuse_distance_t(knobs, stream_t::traits())
+    {
+    }
+    bool
+    process_memref(const memref_t &memref) override
+    {
+        shard_data_t *shard = serial_shard(memref);
+        if (!stream_memref(shard, memref)) {
+            error_string_ = shard->error;
+            return false;
+        }
+        return true;
+    }
+    bool
+    parallel_shard_memref(void *shard_data, const memref_t &memref) override
+    {
+        return stream_memref(reinterpret_cast<shard_data_t *>(shard_data), memref);
+    }
+
+private:
+    bool
+    stream_memref(shard_data_t *shard, const memref_t &memref)
+    {
+        if (!start_record(shard, memref))
+            return true;
+        if (stream_t::DATA &&
+            (memref.data.type == TRACE_TYPE_READ || memref.data.type == TRACE_TYPE_WRITE ||
+             // We may potentially handle prefetches differently.
+             // TRACE_TYPE_PREFETCH_INSTR is handled above.
+             type_is_prefetch(memref.data.type)))
+            process_data_access(shard, memref);
+        else if (stream_t::INSTR && type_is_instr(memref.instr.type)) {
+            account_access(shard, memref.instr.addr, memref.instr.size, memref.instr.addr,
+                           ACCESS_READ);
+        }
+        return true;
+    }
+};
+
+#endif /* _REUSE_DISTANCE_H_ */